@@ -0,0 +1,149 @@
+#!/bin/sh
+#
+# Prints a synthetic input for acl_checker. Every user has a home file
+# and belongs to two groups. Homes are fanout-way spread over depth
+# levels under /home, so depth=1 is shaped like test10.txt (every home
+# right under /home) and a large depth like test12.txt. The file
+# operation section runs the commands in the proportions of mix, given
+# as READ:WRITE:CREATE:ACL:DELETE. Files are created in the home of
+# the user creating them with ACLs of acl entries (with acl=0 they
+# inherit the ACL of the home), and ACL and DELETE commands are run by
+# the owner on the files created so far. ACL commands always give an
+# ACL of at least one entry.
+#
+# Usage: Benchmarks/generate.sh [name=value...]
+#   users=1000 groups=100 depth=1 fanout=26 acl=4 commands=100000
+#   mix=60:25:5:5:5 seed=1
+
+awk -v settings="$*" '
+  function name(n,    s) {
+    s = ""
+    do {
+      s = sprintf("%c", 97 + n % 26) s
+      n = int(n / 26)
+    } while (n > 0)
+    return s
+  }
+
+  function pick(count) {
+    return int(rand() * count)
+  }
+
+  # Prints an ACL of entries entries for a file owned by user n, which
+  # can always change it
+  function printAcl(n, entries,    i) {
+    if (entries == 0) {
+      print "."
+      return
+    }
+
+    printf "u%s.* rw\n", name(n)
+
+    for (i = 1; i < entries; i++) {
+      if (rand() < 0.5) {
+        printf "*.g%s r\n", name(pick(groups))
+      } else {
+        printf "u%s.* %s\n", name(pick(users)), rand() < 0.5 ? "r" : "rw"
+      }
+    }
+
+    print "."
+  }
+
+  BEGIN {
+    users = 1000
+    groups = 100
+    depth = 1
+    fanout = 26
+    acl = 4
+    commands = 100000
+    mix = "60:25:5:5:5"
+    seed = 1
+
+    count = split(settings, pairs, " ")
+
+    for (i = 1; i <= count; i++) {
+      split(pairs[i], pair, "=")
+      values[pair[1]] = pair[2]
+    }
+
+    if ("users" in values) users = values["users"]
+    if ("groups" in values) groups = values["groups"]
+    if ("depth" in values) depth = values["depth"]
+    if ("fanout" in values) fanout = values["fanout"]
+    if ("acl" in values) acl = values["acl"]
+    if ("commands" in values) commands = values["commands"]
+    if ("mix" in values) mix = values["mix"]
+    if ("seed" in values) seed = values["seed"]
+
+    srand(seed)
+    split(mix, weights, ":")
+    total = 0
+
+    for (i = 1; i <= 5; i++) {
+      total += weights[i]
+      limits[i] = total
+    }
+
+    for (i = 0; i < users; i++) {
+      home[i] = "/home"
+
+      for (j = 1; j < depth; j++) {
+        home[i] = home[i] "/" name(pick(fanout))
+      }
+
+      home[i] = home[i] "/u" name(i)
+      printf "u%s.g%s %s\n", name(i), name(i % groups), home[i]
+      printf "u%s.g%s\n", name(i), name((i + 1) % groups)
+    }
+
+    print "."
+
+    # Files created so far and who created them, deleted ones are
+    # replaced by the last one
+    files = 0
+
+    for (i = 0; i < commands; i++) {
+      n = pick(users)
+      user = sprintf("u%s.g%s", name(n), name(n % groups))
+      r = rand() * total
+
+      if (r >= limits[2] && r < limits[3]) {
+        path = home[n] "/f" name(i)
+        printf "CREATE %s %s\n", user, path
+        printAcl(n, acl)
+        owners[files] = n
+        paths[files++] = path
+        continue
+      }
+
+      if (r >= limits[3] && files > 0) {
+        f = pick(files)
+        owner = owners[f]
+        user = sprintf("u%s.g%s", name(owner), name(owner % groups))
+
+        if (r < limits[4]) {
+          printf "ACL %s %s\n", user, paths[f]
+          printAcl(owner, acl > 0 ? acl : 1)
+        } else {
+          printf "DELETE %s %s\n", user, paths[f]
+          owners[f] = owners[--files]
+          paths[f] = paths[files]
+        }
+
+        continue
+      }
+
+      # READ and WRITE go to a created file, the home of the user or
+      # the home of anyone else
+      if (files > 0 && rand() < 0.5) {
+        path = paths[pick(files)]
+      } else if (rand() < 0.5) {
+        path = home[n]
+      } else {
+        path = home[pick(users)]
+      }
+
+      printf "%s %s %s\n", r < limits[1] ? "READ" : "WRITE", user, path
+    }
+  }'
@@ -0,0 +1,100 @@
+#!/bin/sh
+#
+# Compares the character scans (--scan) that check user names, group
+# names and paths. For each workload the same READ commands are timed
+# with every scan the CPU can run, and the time to read the user
+# definition section alone is taken out, so the ns/command column is
+# the cost of a command. The scalar scan checks one character at a
+# time like the parser always did. In the invalid workloads the last
+# character of the name or path is wrong, so each command is little
+# more than the scan.
+#
+# Usage: Benchmarks/scans.sh [commands]
+
+CHECKER=./acl_checker
+COMMANDS=${1:-100000}
+INPUT=/tmp/acl_bench_scans.$$
+USERS=/tmp/acl_bench_scans_users.$$
+
+trap 'rm -f $INPUT $USERS' EXIT
+
+# Prints an input with 100 users whose names have $1 letters, homes at
+# paths with components of $2 letters and $3 commands. $4 is appended
+# to the user names and $5 to the paths of the commands
+generate() {
+  awk -v size="$1" -v component="$2" -v commands="$3" -v user="$4" \
+      -v path="$5" '
+    function name(n, size,    s) {
+      s = ""
+
+      while (length(s) < size) {
+        s = s sprintf("%c", 97 + n % 26)
+        n = int(n / 26) + length(s) * 7
+      }
+
+      return s
+    }
+
+    BEGIN {
+      srand(5)
+
+      for (i = 0; i < 100; i++) {
+        users[i] = name(i, size)
+        home[i] = "/home"
+
+        # Paths are as long as they can be
+        while (length(home[i]) + component + 1 <= 256 - 16) {
+          home[i] = home[i] "/" name(i + length(home[i]), component)
+        }
+
+        printf "%s.%s %s\n", users[i], users[i], home[i]
+      }
+
+      print "."
+
+      for (i = 0; i < commands; i++) {
+        n = int(rand() * 100)
+        printf "READ %s%s.%s %s%s\n", users[n], user, users[n], home[n],
+               path
+      }
+    }'
+}
+
+# Prints the elapsed seconds of running the checker on $1 with --scan $2
+elapsed() {
+  start=$(date +%s.%N)
+  $CHECKER --scan $2 < $1 > /dev/null
+  end=$(date +%s.%N)
+  awk -v s=$start -v e=$end 'BEGIN { printf "%.6f", e - s }'
+}
+
+# Runs the workload named $1 made with the rest of the arguments
+run() {
+  workload=$1
+  shift
+  generate "$1" "$2" $COMMANDS "$3" "$4" > $INPUT
+  generate "$1" "$2" 0 > $USERS
+  line="$(printf "%-14s" $workload)"
+
+  for scan in scalar sse2 avx2; do
+    if ! $CHECKER --scan $scan < /dev/null > /dev/null; then
+      line="$line $(printf "%10s" -)"
+      continue
+    fi
+
+    setup=$(elapsed $USERS $scan)
+    total=$(elapsed $INPUT $scan)
+    line="$line $(awk -v s=$setup -v t=$total -v c=$COMMANDS \
+      'BEGIN { printf "%10d", (t - s) * 1000000000 / c }')"
+  done
+
+  echo "$line"
+}
+
+printf "%-14s %10s %10s %10s\n" "ns/command" scalar sse2 avx2
+
+run short-names 8 8
+run long-names 1024 8
+run invalid-name 4096 8 1
+run long-paths 8 16
+run invalid-path 8 16 "" /X1
@@ -0,0 +1,58 @@
+#!/bin/sh
+#
+# Measures the startup time from a snapshot against parsing the user
+# definition section. For each population size a definition section
+# shaped like test10.txt is generated (one group per ten users, home
+# files fanned out under /home), saved with --save-snapshot and loaded
+# back with --load-snapshot with no commands to run.
+#
+# Usage: Benchmarks/snapshot.sh [sizes...]
+
+CHECKER=./acl_checker
+SIZES=${*:-"10000 100000 1000000"}
+INPUT=/tmp/acl_bench_snapshot.$$
+SNAPSHOT=/tmp/acl_bench_snapshot.$$.snap
+
+trap 'rm -f $INPUT $SNAPSHOT' EXIT
+
+# Prints the definition section for $1 users
+generate() {
+  awk -v users="$1" '
+    function name(n,    s) {
+      s = ""
+      do {
+        s = sprintf("%c", 97 + n % 26) s
+        n = int(n / 26)
+      } while (n > 0)
+      return s
+    }
+
+    BEGIN {
+      for (i = 0; i < users; i++) {
+        u = name(i)
+        printf "u%s.g%s /home/%s/%s/u%s\n", u, name(int(i / 10)),
+               name(i % 26), name(int(i / 26) % 26), u
+      }
+
+      print "."
+    }'
+}
+
+# Prints the elapsed seconds of running the checker with the arguments
+elapsed() {
+  start=$(date +%s.%N)
+  $CHECKER "$@" > /dev/null
+  end=$(date +%s.%N)
+  awk -v s=$start -v e=$end 'BEGIN { printf "%.6f", e - s }'
+}
+
+printf "%10s %12s %12s %12s\n" users text snapshot "size (KB)"
+
+for size in $SIZES; do
+  generate $size > $INPUT
+  $CHECKER --save-snapshot $SNAPSHOT < $INPUT > /dev/null
+  text=$(elapsed --input $INPUT)
+  snapshot=$(elapsed --load-snapshot $SNAPSHOT --input /dev/null)
+  printf "%10d %12.3f %12.3f %12d\n" $size $text $snapshot \
+    $(($(wc -c < $SNAPSHOT) / 1024))
+done
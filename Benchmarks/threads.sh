@@ -0,0 +1,99 @@
+#!/bin/sh
+#
+# Measures how checking runs of READ and WRITE commands scales with the
+# number of threads. A tree of users, groups and nested files is
+# generated, followed by READ and WRITE commands on random files, with a
+# CREATE every few thousand commands to split the runs. acl_checker is
+# timed with every thread count and its output is compared with the
+# single threaded run, which must be identical.
+#
+# Usage: Benchmarks/threads.sh [commands] [threads...]
+
+CHECKER=./acl_checker
+COMMANDS=${1:-2000000}
+shift 2>/dev/null
+THREADS=${*:-$(seq 1 $(nproc))}
+INPUT=/tmp/acl_bench_threads.$$
+OUTPUT=/tmp/acl_bench_threads_out.$$
+EXPECTED=/tmp/acl_bench_threads_expected.$$
+
+trap 'rm -f $INPUT $OUTPUT $EXPECTED' EXIT
+
+# Prints the input with $1 commands
+generate() {
+  awk -v commands="$1" '
+    function name(n,    s) {
+      s = ""
+      do {
+        s = sprintf("%c", 97 + n % 26) s
+        n = int(n / 26)
+      } while (n > 0)
+      return s
+    }
+
+    BEGIN {
+      srand(1)
+      users = 100
+
+      for (i = 0; i < users; i++) {
+        printf "u%s.g%s /home/u%s\n", name(i), name(i % 10), name(i)
+        printf "u%s.g%s\n", name(i), name((i + 1) % 10)
+      }
+
+      print "."
+
+      for (i = 0; i < users; i++) {
+        for (j = 0; j < 4; j++) {
+          printf "CREATE u%s.g%s /home/u%s/d%s\n", name(i), name(i % 10),
+                 name(i), name(j)
+          printf "u%s.* rw\n", name(i)
+          printf "*.g%s r\n", name(j)
+          print "."
+        }
+      }
+
+      for (i = 0; i < commands; i++) {
+        n = int(rand() * users)
+        user = sprintf("u%s.g%s", name(n), name(n % 10))
+        path = sprintf("/home/u%s/d%s", name(int(rand() * users)),
+                       name(int(rand() * 4)))
+
+        if (i % 5000 == 4999) {
+          printf "CREATE %s /home/u%s/n%s\n.\n", user, name(n), name(i)
+        } else if (rand() < 0.7) {
+          printf "READ %s %s\n", user, path
+        } else {
+          printf "WRITE u%s.g%s %s\n", name(n), name((n + 1) % 10), path
+        }
+      }
+    }'
+}
+
+# Prints the elapsed seconds of running the checker with $1 threads
+elapsed() {
+  start=$(date +%s.%N)
+  $CHECKER --input $INPUT --threads $1 > $OUTPUT
+  end=$(date +%s.%N)
+  awk -v s=$start -v e=$end 'BEGIN { printf "%.6f", e - s }'
+}
+
+generate $COMMANDS > $INPUT
+$CHECKER --input $INPUT > $EXPECTED
+
+printf "%8s %12s %10s\n" threads seconds speedup
+
+for threads in $THREADS; do
+  seconds=$(elapsed $threads)
+
+  if ! cmp -s $OUTPUT $EXPECTED; then
+    echo "FAIL: output with $threads threads differs from one thread"
+    exit 1
+  fi
+
+  if [ -z "$base" ]; then
+    base=$seconds
+  fi
+
+  speedup=$(awk -v b=$base -v s=$seconds 'BEGIN { printf "%.2f", b / s }')
+  printf "%8d %12.3f %10s\n" $threads $seconds $speedup
+done
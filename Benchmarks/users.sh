@@ -0,0 +1,70 @@
+#!/bin/sh
+#
+# Measures the per-command cost of user and group lookups as the number
+# of users grows. For each population size a definition section shaped
+# like test10.txt is generated (one group per ten users, home files fanned
+# out under /home so the file tree stays shallow) and acl_checker is timed
+# with and without a run of READ commands on /tmp. The difference divided
+# by the number of commands is the per-command cost.
+#
+# Usage: Benchmarks/users.sh [commands] [sizes...]
+
+CHECKER=./acl_checker
+COMMANDS=${1:-200000}
+shift 2>/dev/null
+SIZES=${*:-"1000 10000 100000"}
+INPUT=/tmp/acl_bench_users.$$
+
+trap 'rm -f $INPUT' EXIT
+
+# Prints the definition section for $1 users followed by $2 READ commands
+generate() {
+  awk -v users="$1" -v commands="$2" '
+    function name(n,    s) {
+      s = ""
+      do {
+        s = sprintf("%c", 97 + n % 26) s
+        n = int(n / 26)
+      } while (n > 0)
+      return s
+    }
+
+    BEGIN {
+      srand(1)
+
+      for (i = 0; i < users; i++) {
+        u = name(i)
+        printf "u%s.g%s /home/%s/%s/u%s\n", u, name(int(i / 10)),
+               name(i % 26), name(int(i / 26) % 26), u
+      }
+
+      print "."
+
+      for (i = 0; i < commands; i++) {
+        n = int(rand() * users)
+        printf "READ u%s.g%s /tmp\n", name(n), name(int(n / 10))
+      }
+    }'
+}
+
+# Prints the elapsed seconds of running the checker on the input
+elapsed() {
+  start=$(date +%s.%N)
+  $CHECKER < $INPUT > /dev/null
+  end=$(date +%s.%N)
+  awk -v s=$start -v e=$end 'BEGIN { printf "%.6f", e - s }'
+}
+
+printf "%10s %12s %12s %16s\n" users setup total ns/command
+
+for size in $SIZES; do
+  generate $size 0 > $INPUT
+  setup=$(elapsed)
+
+  generate $size $COMMANDS > $INPUT
+  total=$(elapsed)
+
+  perCommand=$(awk -v s=$setup -v t=$total -v c=$COMMANDS \
+    'BEGIN { printf "%d", (t - s) * 1000000000 / c }')
+  printf "%10d %12.3f %12.3f %16d\n" $size $setup $total $perCommand
+done
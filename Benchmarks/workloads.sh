@@ -0,0 +1,60 @@
+#!/bin/sh
+#
+# Runs acl_checker on workloads made by Benchmarks/generate.sh and
+# reports the commands per second, the p50 and p99 latency of a
+# command and the peak RSS. The time to read the user definition
+# section alone is taken out of the commands per second. Latencies and
+# RSS come from --stats, which is left out of the timed runs since
+# timing every command slows them down.
+#
+# Usage: Benchmarks/workloads.sh [commands]
+
+CHECKER=./acl_checker
+GENERATE=./Benchmarks/generate.sh
+COMMANDS=${1:-200000}
+INPUT=/tmp/acl_bench_workloads.$$
+USERS=/tmp/acl_bench_workloads_users.$$
+STATS=/tmp/acl_bench_workloads_stats.$$
+
+trap 'rm -f $INPUT $USERS $STATS' EXIT
+
+# Prints the elapsed seconds of running the checker on the file
+elapsed() {
+  start=$(date +%s.%N)
+  $CHECKER --input $1 > /dev/null
+  end=$(date +%s.%N)
+  awk -v s=$start -v e=$end 'BEGIN { printf "%.6f", e - s }'
+}
+
+# Prints the value of the --stats line starting with $1
+stat() {
+  grep "^$1:" $STATS | awk '{ print $(NF - 1) }'
+}
+
+# Runs the workload named $1 made with the rest of the arguments
+run() {
+  workload=$1
+  shift
+  $GENERATE commands=$COMMANDS "$@" > $INPUT
+  $GENERATE commands=0 "$@" > $USERS
+
+  setup=$(elapsed $USERS)
+  total=$(elapsed $INPUT)
+  $CHECKER --input $INPUT --stats 2> $STATS > /dev/null
+
+  rate=$(awk -v s=$setup -v t=$total -v c=$COMMANDS \
+    'BEGIN { printf "%d", (t > s ? c / (t - s) : 0) }')
+  printf "%-10s %12d %12d %10d %10d %10d\n" $workload $COMMANDS $rate \
+    $(stat "latency p50") $(stat "latency p99") $(stat "peak rss")
+}
+
+printf "%-10s %12s %12s %10s %10s %10s\n" workload commands commands/s \
+  "p50 (ns)" "p99 (ns)" "rss (KB)"
+
+run read-only users=10000 mix=70:30:0:0:0
+run mixed users=10000
+run wide users=100000 depth=1 mix=70:30:0:0:0
+run deep users=1000 depth=100 fanout=2 mix=70:30:0:0:0
+run long-acl users=1000 acl=64 mix=40:20:20:20:0
+run churn users=1000 mix=20:10:35:0:35
+run inherit users=1000 acl=0 mix=20:10:70:0:0
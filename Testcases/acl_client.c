@@ -0,0 +1,75 @@
+/*
+ * Sends the commands read from STDIN to an acl_checker started with
+ * --socket and prints the results to STDOUT.
+ *
+ * Usage: acl_client <socket path>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/**
+ * Writes all of the data to the file descriptor.
+ * Returns 0 if it failed, 1 otherwise
+ */
+int writeAll(int fd, char *data, size_t length) {
+  while (length > 0) {
+    ssize_t result = write(fd, data, length);
+
+    if (result < 0) {
+      return 0;
+    }
+
+    data += result;
+    length -= result;
+  }
+
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  struct sockaddr_un address;
+  char buffer[65536];
+  ssize_t length;
+  int fd;
+
+  if (argc != 2 || strlen(argv[1]) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "Usage: acl_client <socket path>\n");
+    return 1;
+  }
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, argv[1]);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+  if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+    perror("acl_client");
+    return 1;
+  }
+
+  // The server reads everything while it answers, so all of the
+  // commands can be sent before reading any result
+  while ((length = read(STDIN_FILENO, buffer, sizeof(buffer))) > 0) {
+    if (!writeAll(fd, buffer, length)) {
+      perror("acl_client");
+      return 1;
+    }
+  }
+
+  shutdown(fd, SHUT_WR);
+
+  while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+    if (!writeAll(STDOUT_FILENO, buffer, length)) {
+      return 1;
+    }
+  }
+
+  close(fd);
+
+  return length < 0;
+}
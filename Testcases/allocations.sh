@@ -0,0 +1,57 @@
+#!/bin/sh
+#
+# Checks that READ and WRITE commands don't allocate memory once the
+# program is warmed up. The same input is run with COMMANDS and with
+# twice as many READ/WRITE commands (allowed, denied and invalid ones)
+# and the number of allocations must not change.
+
+CHECKER=./acl_checker
+COUNTER=./Testcases/malloc_counter.so
+COMMANDS=1000
+INPUT=/tmp/acl_allocations.$$
+
+trap 'rm -f $INPUT' EXIT
+
+# Prints the input with $1 rounds of READ and WRITE commands
+generate() {
+  awk -v rounds="$1" 'BEGIN {
+    print "alice.staff /home/alice"
+    print "bob.staff /home/bob"
+    print "bob.admin"
+    print "."
+    print "CREATE alice.staff /home/alice/notes"
+    print "alice.staff rw"
+    print "bob.* r"
+    print "."
+
+    for (i = 0; i < rounds; i++) {
+      print "READ alice.staff /home/alice/notes"
+      print "READ bob.admin /home/alice/notes"
+      print "WRITE alice.staff /home/alice/notes"
+      print "WRITE bob.staff /home/alice/notes"
+      print "READ bob.staff /home/alice/missing"
+      print "READ nobody.staff /tmp"
+      print "WRITE bob.admin /tmp//bad"
+    }
+  }'
+}
+
+# Prints the number of allocations made by the checker for the input
+allocations() {
+  LD_PRELOAD=$COUNTER $CHECKER < $INPUT 2>&1 > /dev/null |
+    awk '/^allocations:/ { print $2 }'
+}
+
+generate $COMMANDS > $INPUT
+first=$(allocations)
+
+generate $((COMMANDS * 2)) > $INPUT
+second=$(allocations)
+
+if [ -z "$first" ] || [ "$first" != "$second" ]; then
+  echo "FAIL: $COMMANDS rounds made $first allocations," \
+       "$((COMMANDS * 2)) rounds made $second"
+  exit 1
+fi
+
+echo "OK: READ and WRITE commands made no allocations ($first in total)"
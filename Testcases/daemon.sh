@@ -0,0 +1,101 @@
+#!/bin/sh
+#
+# Checks the server started with --socket. For every test input the
+# user definition section is given to the server and the file
+# operation section is sent by a client, the output of both must be
+# the same as running the input directly. Then several clients send
+# the same READ and WRITE commands at once and must all get the
+# results of running them directly, also after a client sent a command
+# too big to be served.
+
+CHECKER=./acl_checker
+CLIENT=./Testcases/acl_client
+SOCKET=/tmp/acl_daemon.$$.sock
+USERS=/tmp/acl_daemon_users.$$
+COMMANDS=/tmp/acl_daemon_commands.$$
+EXPECTED=/tmp/acl_daemon_expected.$$
+OUTPUT=/tmp/acl_daemon_out.$$
+CLIENTS=8
+
+trap 'rm -f $SOCKET $USERS $COMMANDS $EXPECTED $OUTPUT*' EXIT
+
+# Splits the input into the user definition section and the rest
+split() {
+  : > $COMMANDS
+  awk -v users=$USERS -v commands=$COMMANDS '
+    !done { print > users; done = $0 == "."; next }
+    { print > commands }' "$1"
+}
+
+# Starts the server with the user definition section
+start() {
+  rm -f $SOCKET
+  $CHECKER --socket $SOCKET < $USERS > $OUTPUT &
+  server=$!
+
+  while [ ! -S $SOCKET ]; do
+    sleep 0.01
+  done
+}
+
+# Stops the server and waits for it to exit
+stop() {
+  kill $server
+  wait $server
+}
+
+fail=0
+
+for input in test*.txt Testcases/case*.test; do
+  split $input
+  $CHECKER < $input > $EXPECTED
+  start
+  $CLIENT $SOCKET < $COMMANDS > $OUTPUT.client
+  stop
+
+  if ! cat $OUTPUT $OUTPUT.client | cmp -s - $EXPECTED; then
+    echo "FAIL: $input differs when served over the socket"
+    fail=1
+  fi
+done
+
+# The users of test5.txt with every READ and WRITE command of the tests
+split test5.txt
+cat test*.txt Testcases/case*.test | grep -E '^(READ|WRITE) ' > $COMMANDS
+cat $USERS $COMMANDS | $CHECKER | tail -n $(wc -l < $COMMANDS) > $EXPECTED
+start
+
+clients=""
+
+for client in $(seq $CLIENTS); do
+  $CLIENT $SOCKET < $COMMANDS > $OUTPUT.$client &
+  clients="$clients $!"
+done
+
+wait $clients
+
+# A command over the size limit only costs its own client the
+# connection, the next client is still served
+{ printf 'READ '; head -c 17000000 /dev/zero | tr '\0' a; } |
+  $CLIENT $SOCKET > /dev/null 2>&1
+$CLIENT $SOCKET < $COMMANDS > $OUTPUT.after
+
+stop
+
+for client in $(seq $CLIENTS); do
+  if ! cmp -s $OUTPUT.$client $EXPECTED; then
+    echo "FAIL: client $client of $CLIENTS got different results"
+    fail=1
+  fi
+done
+
+if ! cmp -s $OUTPUT.after $EXPECTED; then
+  echo "FAIL: a client after a too big command got different results"
+  fail=1
+fi
+
+if [ $fail = 0 ]; then
+  echo "OK: the results over the socket are the same as running directly"
+fi
+
+exit $fail
@@ -0,0 +1,108 @@
+#!/bin/sh
+#
+# Checks --journal. For every test input its file operation section is
+# run with a journal and then again with the same journal, which must
+# give the same results as running it twice in a row. The same is done
+# on top of a snapshot, with a journal left behind by an older
+# snapshot and with a journal whose last record was cut short.
+
+CHECKER=./acl_checker
+JOURNAL=/tmp/acl_journal.$$
+STALE=/tmp/acl_journal_stale.$$
+SNAPSHOT=/tmp/acl_journal_snapshot.$$
+FINAL=/tmp/acl_journal_final.$$
+USERS=/tmp/acl_journal_users.$$
+COMMANDS=/tmp/acl_journal_commands.$$
+EXPECTED=/tmp/acl_journal_expected.$$
+OUTPUT=/tmp/acl_journal_out.$$
+
+trap 'rm -f $JOURNAL $STALE $SNAPSHOT $FINAL $USERS $COMMANDS $EXPECTED \
+  $OUTPUT' EXIT
+
+# Splits the input into the user definition section and the rest
+split() {
+  : > $COMMANDS
+  awk -v users=$USERS -v commands=$COMMANDS '
+    !done { print > users; done = $0 == "."; next }
+    { print > commands }' "$1"
+}
+
+fail=0
+
+for input in test*.txt Testcases/case*.test; do
+  split $input
+
+  # Inputs with no file operation section have nothing to check
+  if [ ! -s $COMMANDS ]; then
+    continue
+  fi
+
+  # Lines are numbered on from the first run, so numbers are left out
+  lines=$(($($CHECKER < $input | wc -l) - $(wc -l < $USERS) + 1))
+  cat $input $COMMANDS | $CHECKER | cut -f 2- | tail -n $lines > $EXPECTED
+
+  rm -f $JOURNAL
+  $CHECKER --journal $JOURNAL < $input > /dev/null
+  $CHECKER --journal $JOURNAL < $input | cut -f 2- | tail -n $lines \
+    > $OUTPUT
+
+  if ! cmp -s $OUTPUT $EXPECTED; then
+    echo "FAIL: $input differs when its changes come from the journal"
+    fail=1
+  fi
+
+  rm -f $JOURNAL
+  $CHECKER --journal $JOURNAL < $input > /dev/null
+  printf 'torn' >> $JOURNAL
+  $CHECKER --journal $JOURNAL < $input | cut -f 2- | tail -n $lines \
+    > $OUTPUT
+
+  if ! cmp -s $OUTPUT $EXPECTED; then
+    echo "FAIL: $input differs when the journal ends in a torn record"
+    fail=1
+  fi
+
+  rm -f $JOURNAL
+  $CHECKER --journal $JOURNAL --save-snapshot $SNAPSHOT < $USERS > /dev/null
+  $CHECKER --load-snapshot $SNAPSHOT --journal $JOURNAL < $COMMANDS \
+    > /dev/null
+  $CHECKER --threads 3 --load-snapshot $SNAPSHOT --journal $JOURNAL \
+    < $COMMANDS | cut -f 2- > $OUTPUT
+
+  if ! cmp -s $OUTPUT $EXPECTED; then
+    echo "FAIL: $input differs when a snapshot is followed by the journal"
+    fail=1
+  fi
+
+  # A crash right after saving a snapshot leaves its records behind
+  cp $JOURNAL $STALE
+  $CHECKER --load-snapshot $SNAPSHOT --journal $JOURNAL \
+    --save-snapshot $FINAL < /dev/null > /dev/null
+  $CHECKER --load-snapshot $FINAL < $COMMANDS > $EXPECTED
+  $CHECKER --load-snapshot $FINAL --journal $STALE < $COMMANDS > $OUTPUT
+
+  if ! cmp -s $OUTPUT $EXPECTED; then
+    echo "FAIL: $input replays journal records its snapshot already has"
+    fail=1
+  fi
+done
+
+# Saving a snapshot starts the journal after records that the user
+# definition section alone doesn't have
+printf 'alice.staff /home/alice\n.\n' > $USERS
+rm -f $JOURNAL
+printf 'CREATE alice.staff /home/alice/notes\n.\n' |
+  cat $USERS - | $CHECKER --journal $JOURNAL --save-snapshot $SNAPSHOT \
+  > /dev/null
+
+if [ "$($CHECKER --journal $JOURNAL < $USERS | tail -n 1)" != \
+     "Error: Invalid journal" ]; then
+  echo "FAIL: a journal with missing records was replayed"
+  fail=1
+fi
+
+if [ $fail = 0 ]; then
+  echo "OK: the results with a journal are the same as running directly"
+fi
+
+exit $fail
@@ -0,0 +1,33 @@
+/*
+ * Counts the calls to malloc, calloc and realloc made by a program.
+ * Load it with LD_PRELOAD, the count is printed to STDERR at exit as
+ * "allocations: <count>".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long allocations = 0;
+
+void *malloc(size_t size) {
+  allocations++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+  allocations++;
+  return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  allocations++;
+  return __libc_realloc(ptr, size);
+}
+
+__attribute__((destructor)) static void printAllocations() {
+  fprintf(stderr, "allocations: %lu\n", allocations);
+}
@@ -0,0 +1,51 @@
+#!/bin/sh
+#
+# Checks --metrics. For every test input the Y, N and X results counted
+# in the JSON must add up to the results printed for the file operation
+# section, with one and with several threads.
+
+CHECKER=./acl_checker
+OUTPUT=/tmp/acl_metrics_out.$$
+METRICS=/tmp/acl_metrics.$$
+USERS=/tmp/acl_metrics_users.$$
+
+trap 'rm -f $OUTPUT $METRICS $USERS' EXIT
+
+# Prints the sum of the JSON fields named $1
+sum() {
+  grep -o "\"$1\": [0-9]*" $METRICS | awk '{ total += $2 } END { print total }'
+}
+
+# Prints the number of results of commands with the verdict $1. The
+# user definition section has a line less of output than of input
+results() {
+  tail -n +$(wc -l < $USERS) $OUTPUT |
+    awk -F '\t' -v verdict=$1 '$2 == verdict' | wc -l
+}
+
+fail=0
+
+for input in test*.txt Testcases/case*.test; do
+  awk '{ print } $0 == "." { exit }' $input > $USERS
+
+  # Inputs with no file operation section have nothing to count
+  if [ "$(tail -n 1 $USERS)" != "." ]; then
+    continue
+  fi
+
+  for threads in 1 3; do
+    $CHECKER --metrics --threads $threads < $input > $OUTPUT 2> $METRICS
+
+    if [ $(sum yes) != $(results Y) ] || [ $(sum no) != $(results N) ] ||
+       [ $(sum invalid) != $(results X) ]; then
+      echo "FAIL: $input counts other results with $threads threads"
+      fail=1
+    fi
+  done
+done
+
+if [ $fail = 0 ]; then
+  echo "OK: the metrics count every result"
+fi
+
+exit $fail
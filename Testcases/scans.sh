@@ -0,0 +1,95 @@
+#!/bin/sh
+#
+# Checks that every character scan the CPU can run (--scan) gives the
+# same output as the scalar one. Every test input is checked, along
+# with a generated input of long user names, group names and paths with
+# an invalid character, an uppercase letter, a dot or two slashes in a
+# row at random places, so they fall on every position of a chunk.
+
+CHECKER=./acl_checker
+INPUT=/tmp/acl_scans.$$
+EXPECTED=/tmp/acl_scans_expected.$$
+OUTPUT=/tmp/acl_scans_out.$$
+
+trap 'rm -f $INPUT $EXPECTED $OUTPUT' EXIT
+
+# Prints an input with $1 users and $2 commands
+generate() {
+  awk -v users="$1" -v commands="$2" '
+    # Prints a name of up to 80 lowercase letters, which sometimes has
+    # one of the characters in odd
+    function name(odd,    s, size, i) {
+      size = int(rand() * 80) + 1
+      s = ""
+
+      for (i = 0; i < size; i++) {
+        s = s sprintf("%c", 97 + int(rand() * 26))
+      }
+
+      if (rand() < 0.3) {
+        i = int(rand() * size)
+        s = substr(s, 1, i) substr(odd, int(rand() * 6) + 1, 1) \
+            substr(s, i + 2)
+      }
+
+      return s
+    }
+
+    # Prints a path of up to 8 components
+    function path(    s, count, i) {
+      count = int(rand() * 8) + 1
+      s = ""
+
+      for (i = 0; i < count; i++) {
+        s = s "/" substr(name("A.Z/_1"), 1, 18)
+      }
+
+      return s
+    }
+
+    BEGIN {
+      srand(4)
+
+      for (i = 0; i < users; i++) {
+        user[i] = name("A_1.-/")
+        group[i] = name("A_1.-/")
+        printf "%s.%s %s\n", user[i], group[i], path()
+      }
+
+      print "."
+
+      for (i = 0; i < commands; i++) {
+        n = int(rand() * users)
+        printf "%s %s.%s %s\n", rand() < 0.5 ? "READ" : "WRITE", user[n],
+               group[n], path()
+      }
+    }'
+}
+
+fail=0
+
+generate 2000 20000 > $INPUT
+
+for input in test*.txt Testcases/case*.test $INPUT; do
+  $CHECKER --scan scalar < $input > $EXPECTED
+
+  for scan in sse2 avx2; do
+    # Skips the scans this CPU can't run
+    if ! $CHECKER --scan $scan < /dev/null > /dev/null; then
+      continue
+    fi
+
+    $CHECKER --scan $scan < $input > $OUTPUT
+
+    if ! cmp -s $OUTPUT $EXPECTED; then
+      echo "FAIL: $input differs with the $scan character scans"
+      fail=1
+    fi
+  done
+done
+
+if [ $fail = 0 ]; then
+  echo "OK: every character scan gives the same output"
+fi
+
+exit $fail
@@ -0,0 +1,72 @@
+#!/bin/sh
+#
+# Checks --save-snapshot and --load-snapshot. For every test input the
+# state after the user definition section is saved and the file
+# operation section is run on the loaded snapshot, the results must be
+# the same as running the input directly. Then the state at the end of
+# the input is saved and its file operation section is run again on
+# it, which must give the same results as running it twice in a row.
+
+CHECKER=./acl_checker
+SNAPSHOT=/tmp/acl_snapshot.$$
+USERS=/tmp/acl_snapshot_users.$$
+COMMANDS=/tmp/acl_snapshot_commands.$$
+EXPECTED=/tmp/acl_snapshot_expected.$$
+OUTPUT=/tmp/acl_snapshot_out.$$
+
+trap 'rm -f $SNAPSHOT $USERS $COMMANDS $EXPECTED $OUTPUT' EXIT
+
+# Splits the input into the user definition section and the rest
+split() {
+  : > $COMMANDS
+  awk -v users=$USERS -v commands=$COMMANDS '
+    !done { print > users; done = $0 == "."; next }
+    { print > commands }' "$1"
+}
+
+fail=0
+
+for input in test*.txt Testcases/case*.test; do
+  split $input
+
+  # Inputs with no file operation section have nothing to check
+  if [ ! -s $COMMANDS ]; then
+    continue
+  fi
+
+  $CHECKER --save-snapshot $SNAPSHOT < $USERS > /dev/null
+  $CHECKER < $input | tail -n +$(wc -l < $USERS) > $EXPECTED
+  $CHECKER --load-snapshot $SNAPSHOT < $COMMANDS > $OUTPUT
+
+  if ! cmp -s $OUTPUT $EXPECTED; then
+    echo "FAIL: $input differs when the users come from a snapshot"
+    fail=1
+  fi
+
+  # Lines are numbered on from the first run, so numbers are left out
+  $CHECKER --save-snapshot $SNAPSHOT < $input > /dev/null
+  cat $input $COMMANDS | $CHECKER | cut -f 2- |
+    tail -n $(($($CHECKER < $input | wc -l) - $(wc -l < $USERS) + 1)) \
+    > $EXPECTED
+  $CHECKER --threads 3 --load-snapshot $SNAPSHOT < $COMMANDS | cut -f 2- \
+    > $OUTPUT
+
+  if ! cmp -s $OUTPUT $EXPECTED; then
+    echo "FAIL: $input differs when run again on its final snapshot"
+    fail=1
+  fi
+done
+
+echo "not a snapshot" > $SNAPSHOT
+
+if [ "$($CHECKER --load-snapshot $SNAPSHOT < /dev/null)" != \
+     "Error: Invalid snapshot" ]; then
+  echo "FAIL: an invalid snapshot was loaded"
+  fail=1
+fi
+
+if [ $fail = 0 ]; then
+  echo "OK: the results with snapshots are the same as running directly"
+fi
+
+exit $fail
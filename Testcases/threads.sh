@@ -0,0 +1,144 @@
+#!/bin/sh
+#
+# Checks that the output with several threads is the same as with one.
+# Every test input is checked, along with a generated input with long
+# runs of READ and WRITE commands on nested files split by CREATE, ACL
+# and DELETE commands, and one where the commands are mixed at random
+# so the workers check queries while the tree keeps changing.
+
+CHECKER=./acl_checker
+INPUT=/tmp/acl_threads.$$
+MIXED=/tmp/acl_threads_mixed.$$
+EXPECTED=/tmp/acl_threads_expected.$$
+OUTPUT=/tmp/acl_threads_out.$$
+
+trap 'rm -f $INPUT $MIXED $EXPECTED $OUTPUT' EXIT
+
+# Prints an input with $1 rounds of commands
+generate() {
+  awk -v rounds="$1" 'BEGIN {
+    srand(2)
+    split("alice bob carol dave", users, " ")
+    split("staff admin", groups, " ")
+    split("/tmp /home/alice /home/alice/a /home/alice/a/b /home/bob /x",
+          paths, " ")
+
+    print "alice.staff /home/alice"
+    print "bob.staff /home/bob"
+    print "bob.admin"
+    print "carol.admin /home/carol"
+    print "."
+    print "CREATE alice.staff /home/alice/a"
+    print "."
+    print "CREATE alice.staff /home/alice/a/b"
+    print "alice.* rw"
+    print "*.admin r"
+    print "."
+
+    for (i = 0; i < rounds; i++) {
+      for (j = 0; j < 50; j++) {
+        command = rand() < 0.5 ? "READ" : "WRITE"
+        printf "%s %s.%s %s\n", command, users[int(rand() * 4) + 1],
+               groups[int(rand() * 2) + 1], paths[int(rand() * 6) + 1]
+      }
+
+      if (i % 2 == 0) {
+        print "CREATE alice.staff /home/alice/a/c"
+        print "."
+        print "ACL alice.staff /home/alice/a"
+        print "*.staff r"
+        print "."
+      } else {
+        print "DELETE alice.staff /home/alice/a/c"
+        print "ACL alice.staff /home/alice/a"
+        print "alice.* rw"
+        print "*.admin r"
+        print "."
+      }
+    }
+  }'
+}
+
+# Prints an input with $1 commands picked at random. The ACL commands
+# add users and groups, and files come and go in directories that have
+# more children than fit inline
+generateMixed() {
+  awk -v commands="$1" 'BEGIN {
+    srand(3)
+    split("alice bob eve frank", users, " ")
+    split("staff admin ops", groups, " ")
+    # Users and groups that eve and frank are added to by ACL commands
+    split("alice.staff bob.admin eve.ops frank.staff frank.ops", pairs, " ")
+    letters = "abcdefghijkl"
+
+    print "alice.staff /home/alice"
+    print "bob.admin /home/bob"
+    print "."
+    print "ACL alice.staff /tmp"
+    print "*.* rw"
+    print "."
+
+    for (i = 0; i < commands; i++) {
+      user = pairs[int(rand() * 5) + 1]
+
+      if (rand() < 0.2) {
+        user = users[int(rand() * 4) + 1] "." groups[int(rand() * 3) + 1]
+      }
+
+      # File names only have letters
+      path = "/tmp/d" substr(letters, int(rand() * 12) + 1, 1)
+
+      if (rand() < 0.5) {
+        path = path "/f" substr(letters, int(rand() * 12) + 1, 1)
+      }
+
+      choice = rand()
+
+      if (choice < 0.6) {
+        printf "%s %s %s\n", rand() < 0.5 ? "READ" : "WRITE", user, path
+      } else if (choice < 0.75) {
+        printf "CREATE %s %s\n", user, path
+
+        if (rand() < 0.3) {
+          print users[int(rand() * 4) + 1] ".* rw"
+          print "*.* r"
+        }
+
+        print "."
+      } else if (choice < 0.9) {
+        printf "DELETE %s %s\n", user, path
+      } else {
+        printf "ACL %s %s\n", user, path
+        # Some files can be changed but nobody can read them
+        closed = rand() < 0.05
+        print pairs[int(rand() * 5) + 1] (closed ? " w" : " r")
+        print "*.* " (closed ? "-" : rand() < 0.9 ? "rw" : "r")
+        print "."
+      }
+    }
+  }'
+}
+
+fail=0
+
+generate 200 > $INPUT
+generateMixed 20000 > $MIXED
+
+for input in test*.txt Testcases/case*.test $INPUT $MIXED; do
+  $CHECKER < $input > $EXPECTED
+
+  for threads in 2 3 8; do
+    $CHECKER --threads $threads < $input > $OUTPUT
+
+    if ! cmp -s $OUTPUT $EXPECTED; then
+      echo "FAIL: $input differs with $threads threads"
+      fail=1
+    fi
+  done
+done
+
+if [ $fail = 0 ]; then
+  echo "OK: the output with several threads is the same as with one"
+fi
+
+exit $fail
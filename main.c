@@ -5,16 +5,53 @@
  */
 
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #define MAX_CMP_SIZE 16
 #define MAX_FILE_NAME_SIZE 256
+#define MAX_PATH_COMPONENTS (MAX_FILE_NAME_SIZE / 2 + 1)
 #define INITIAL_LINE_SIZE 100
-
-#define U_VALID 0
-#define U_INVALID 1
+#define READ_BUFFER_SIZE 65536
+#define OUTPUT_BUFFER_SIZE 65536
+#define POOL_BLOCK_SIZE 65536
+#define INITIAL_INDEX_SIZE 64
+#define INITIAL_MEMBERSHIP_SIZE 4
+#define INLINE_CHILDREN_SIZE 4
+#define INITIAL_CHILDREN_INDEX_SIZE 16
+#define PATH_CACHE_SIZE 1024 // Must be a power of two
+#define INITIAL_ACL_RULES_SIZE 4
+#define SUMMARY_SLOTS 8 // Must be a power of two
+#define BATCH_SIZE 1024
+#define BATCH_TEXT_SIZE 65536
+#define BATCHES_IN_FLIGHT 4
+#define MAX_THREADS 64
+#define MAX_EVENTS 64
+#define MAX_CLIENT_INPUT_SIZE (16 * 1024 * 1024)
+#define JOURNAL_BUFFER_SIZE 65536
+#define LATENCY_BUCKETS 512 // 8 per power of two up to 2^63 ns
+#define SNAPSHOT_MAGIC "ACLSNAP2"
+#define JOURNAL_MAGIC "ACLJRNL1"
+
+#define ACL_ANY -1
+#define ACL_READ 1
+#define ACL_WRITE 2
 
 #define C_YES 0
 #define C_NO 1
@@ -22,26 +59,145 @@
 
 #define DEBUGGING 0
 
+// Versions of the tree. Every command that may change it gets a new
+// one, and queries see the tree as it was at the version they carry
+#define VERSION_LATEST (~0UL - 1) // Sees every change made so far
+#define VERSION_NEVER (~0UL)      // deletedVersion of existing files
+
+// Accesses to the fields that the main thread changes while workers
+// read them
+#define loadShared(pointer) __atomic_load_n(pointer, __ATOMIC_ACQUIRE)
+#define storeShared(pointer, value) \
+  __atomic_store_n(pointer, value, __ATOMIC_RELEASE)
+
+// Adds to a work counter of the thread when metrics are collected.
+// Only the thread itself writes its counters, so no atomic add is
+// needed, but other threads may read them at any time
+#define countWork(field, count)                                         \
+  (collectMetrics ? __atomic_store_n(&threadCounters->field,            \
+                                     threadCounters->field + (count),   \
+                                     __ATOMIC_RELAXED)                  \
+                  : (void)0)
+
+struct acl_rule {
+  int userId;  // ACL_ANY for "*"
+  int groupId; // ACL_ANY for "*"
+  int permissions;
+};
+
+// The ACL of a file flattened into an array for evaluation. Entries
+// after the first "*.*" can never match so they are left out and the
+// permissions of that entry become the fallback. A new one replaces
+// it when the ACL changes while queries may still read the old one
+struct compiled_acl {
+  struct acl_rule *rules;
+  int count;
+  int size;
+  int hasFallback;
+  int fallback;
+  unsigned long version;      // The first version that uses it
+  struct compiled_acl *older; // What older versions use
+  // Files using it, and newer ones whose older it is. A shared one is
+  // never changed in place
+  int references;
+};
+
+// The ACL entries of one or more files. A file created without an ACL
+// shares the list (and the compiled ACL) of its parent until it is
+// given an ACL of its own. Only the main thread uses them
+struct acl_list {
+  struct acl_entry *head;
+  struct acl_entry *tail;
+  int references;
+};
+
+struct read_memo {
+  int userId;
+  int groupId;
+  unsigned int generation;
+  int readable;
+};
+
+// Who can read every file from the root down to a directory
+enum traverse_state {
+  TRAVERSE_SOME, // Depends on the principal
+  TRAVERSE_ALL,
+  TRAVERSE_NONE,
+};
+
+// Who can read every file from the root down to a directory. When it
+// depends on the principal, the answer for the last principals that
+// went through it is kept, each in the slot picked by its user and
+// group ids. Everything in it is stale once aclGeneration changes
+struct traverse_summary {
+  unsigned int generation; // For state
+  enum traverse_state state;
+  struct read_memo slots[SUMMARY_SLOTS];
+};
+
+// A file name of up to MAX_CMP_SIZE characters packed into two words
+// and padded with NULs, so two names are compared as two integers
+struct component_key {
+  uint64_t words[2];
+  unsigned int length;
+  unsigned int hash; // hashName of the name
+};
+
 struct file_struct {
   struct file_struct *next;
+  struct file_struct *prev;
   struct file_struct *parent;
   struct file_struct *children;
-  struct acl_entry *aclHead;
-  struct acl_entry *aclTail;
-  char cmpName[MAX_CMP_SIZE + 1];
+  struct acl_list *acl;
+  struct compiled_acl *compiledAcl;
+  // Children are looked up in inlineChildren until more than
+  // INLINE_CHILDREN_SIZE of them were added, then in childrenIndex.
+  // Removed children are replaced by &removedChild in both
+  struct file_struct *inlineChildren[INLINE_CHILDREN_SIZE];
+  unsigned int inlineChildrenCount;
+  struct children_index *childrenIndex;
+  unsigned long createdVersion;
+  unsigned long deletedVersion; // VERSION_NEVER while the file exists
+  // NULL until a file under it is checked at the latest version
+  struct traverse_summary *summary;
+  struct component_key key;
 };
 
 struct user_struct {
   char *username;
+  int id;
   struct user_struct *next; // Only used to traverse all users
   struct user_group_list *groups;
   struct file_struct *file;
+  struct membership *membership;
+  unsigned long createdVersion;
 };
 
 struct group_struct {
   char *groupname;
+  int id;
   struct group_struct *next; // Only used to traverse all groups
   struct group_user_list *users;
+  unsigned long createdVersion;
+};
+
+// Sorted ids of the groups a user belongs to. A new one replaces it
+// when it changes while queries may still read the old one
+struct membership {
+  unsigned long version;     // The first version that uses it
+  struct membership *older;  // What older versions use
+  int count;
+  int size;
+  int groupIds[];
+};
+
+// Open addressing table with the children of a file. Slots are never
+// moved or emptied so readers can probe while children are added
+struct children_index {
+  unsigned int size;  // Always a power of two
+  unsigned int used;  // Slots that are not NULL
+  unsigned int count; // Slots with a child that wasn't removed
+  struct file_struct *slots[];
 };
 
 struct group_user_list {
@@ -62,1830 +218,5855 @@ struct acl_entry {
   int writePermission;
 };
 
-struct error_struct {
-  int read;
+// A component of a path. The name points into the path and is not NUL
+// terminated. The key has what fits in MAX_CMP_SIZE of it
+struct path_component {
+  char *name;
+  int length;
+  struct component_key key;
+};
+
+// A path split into its components. The root has none
+struct file_path {
+  struct path_component components[MAX_PATH_COMPONENTS];
+  int count;
+};
+
+// A piece of a line. It is not NUL terminated
+struct span {
+  char *start;
+  int length;
+};
+
+struct name_slot {
+  unsigned int hash;
+  char *name;
+  void *entry;
+};
+
+struct name_table {
+  unsigned int size; // Always a power of two
+  struct name_slot slots[];
+};
+
+// Entries are never removed, the table is replaced when it grows
+struct name_index {
+  struct name_table *table;
+  unsigned int count;
+};
+
+struct path_cache_entry {
+  unsigned int hash;
+  unsigned int generation;
+  struct file_struct *file; // NULL if the path didn't exist
+  char path[MAX_FILE_NAME_SIZE + 2];
+};
+
+// Lines handed out by getLine point into the buffer, they are only
+// valid until the next call unless the whole input is mapped
+struct line_reader {
+  int fd;
+  char *buffer;
+  size_t size;
+  size_t start; // First byte not handed out yet
+  size_t end;   // End of the bytes read so far
+  int eof;
+  int mapped; // The buffer is the input file mapped read only
+};
+
+struct pool_block {
+  struct pool_block *next;
+  // Aligned for any of the structs kept in pools
+  char objects[] __attribute__((aligned(sizeof(void *))));
+};
+
+// Hands out objects of a single size carved from big blocks. Freed
+// objects go to a free list that is used before carving new ones
+struct pool {
+  size_t objectSize; // At least sizeof(void *) to hold the free list
+  struct pool_block *blocks;
+  char *next; // Next unused object in the current block
+  char *end;
+  void *freeList;
+  unsigned long allocated;
+  unsigned long freed;
+  unsigned long blocksCount;
+};
+
+struct output_buffer {
+  char buffer[OUTPUT_BUFFER_SIZE];
+  size_t length;
+  int lineBuffered;      // Flush after every line, for interactive use
+  struct client *client; // Output goes to the client instead of STDOUT
+};
+
+// Every error a line can have. The verdict and message of each one
+// are in the errors table
+enum error_code {
+  E_NONE,
+  E_UNDEFINED_PATH,
+  E_PATH_START,
+  E_FILE_CHARACTERS,
+  E_COMPONENT_LENGTH,
+  E_PATH_END,
+  E_DOUBLE_SLASH,
+  E_PATH_LENGTH,
+  E_FILE_EXISTED,
+  E_USER_CHARACTERS,
+  E_EMPTY_USER,
+  E_GROUP_CHARACTERS,
+  E_EMPTY_GROUP,
+  E_MISSING_DOT,
+  E_MISSING_FIRST_FILE,
+  E_NOT_FIRST_FILE,
+  E_INVALID_PERMISSIONS,
+  E_MISSING_PERMISSIONS,
+  E_END_OF_FILE,
+  E_NULL_ACL,
+  E_NO_PARENT,
+  E_FILE_EXISTS,
+  E_NO_FILE,
+  E_NO_USER,
+  E_NO_GROUP,
+  E_NOT_IN_GROUP,
+  E_INVALID_COMMAND,
+  E_MISSING_FILE,
+  E_CANT_READ,
+  E_CANT_WRITE,
+  E_CANT_WRITE_ROOT,
+  E_HAS_CHILDREN,
+  E_DELETE_ROOT,
+  E_COMMAND_SIZE,
+};
+
+struct error_info {
+  int verdict; // C_YES, C_NO or C_INVALID
   char *message;
 };
 
+// A READ or WRITE check that doesn't change the tree
+struct permission_query {
+  struct span username;
+  struct span groupname;
+  char *path;
+  int operation;         // ACL_READ, ACL_WRITE or 0 if it already ran
+  unsigned long version; // Version of the tree it is checked against
+  unsigned long latency; // Nanoseconds the check took, with --stats
+};
+
+// Lines waiting for their results to be printed. The lines and paths
+// are copied to text so they outlive the input. With worker threads
+// the commands that change the tree run right away and only their
+// results wait here
+struct command_batch {
+  struct permission_query queries[BATCH_SIZE];
+  enum error_code results[BATCH_SIZE];
+  struct span lines[BATCH_SIZE];
+  char text[BATCH_TEXT_SIZE];
+  size_t textLength;
+  int count;
+  int firstNum;                // Number of the first line in the batch
+  unsigned long oldestVersion; // Of its queries, VERSION_NEVER if none
+  int pending;                 // Workers that haven't checked their part
+};
+
+// How long commands took. Values of the same power of two are split in
+// 8 buckets, so a percentile is off by at most an eighth
+struct latency_histogram {
+  unsigned long counts[LATENCY_BUCKETS];
+  unsigned long total;
+  unsigned long max;
+};
+
+enum command_type {
+  CMD_READ,
+  CMD_WRITE,
+  CMD_CREATE,
+  CMD_ACL,
+  CMD_DELETE,
+  CMD_OTHER, // Lines with no valid command
+  CMD_TYPES
+};
+
+// What the commands of one type came to and how long they took
+struct command_metrics {
+  unsigned long verdicts[3]; // Indexed by C_YES, C_NO and C_INVALID
+  struct latency_histogram latency;
+};
+
+// Work done by one thread while checking commands. Each thread has
+// its own cache line
+struct work_counters {
+  unsigned long nodesVisited;      // Files whose ACL was checked
+  unsigned long aclEntriesScanned; // Compiled ACL rules evaluated
+  unsigned long childrenScanned;   // Children compared to a name
+} __attribute__((aligned(64)));
+
+// Finds where a run of valid characters ends in the names and paths of
+// a line. There is one of these for each instruction set, the best one
+// the CPU has is picked when the program starts
+struct character_scans {
+  char *name;
+  // First character in [start, end) that is not a lowercase letter
+  char *(*skipLetters)(char *start, char *end);
+  // First character in [start, end) that can't be in a file name
+  char *(*skipNameCharacters)(char *start, char *end);
+  // First character in [start, end) that can't be in a path or the
+  // second slash of two in a row. start has to be the first /
+  char *(*skipPathCharacters)(char *start, char *end);
+};
+
+// A worker thread. Worker i checks the i-th part of every batch
+struct worker {
+  pthread_t thread;
+  int index;
+};
+
+enum retired_kind {
+  RETIRED_FILE,       // Deleted file, still in the children of its parent
+  RETIRED_ACL,        // Compiled ACL replaced by a newer one
+  RETIRED_MEMBERSHIP, // Membership replaced by a newer one
+  RETIRED_MEMORY,     // Table that nothing points to anymore
+};
+
+// An object that queries checked against older versions may still
+// read. It is first unlinked once no such query is left, and freed
+// once every batch that could have reached it is done
+struct retired_object {
+  struct retired_object *next;
+  enum retired_kind kind;
+  void *object;
+  void **link;           // Where the newer version points to it
+  unsigned long version; // Queries from this version on don't use it
+  int unlinked;
+  unsigned long unlinkedBatch; // Batches dispatched when it was unlinked
+};
+
+// A connection of the server. Commands are buffered until all of
+// their lines are there and results until the socket takes them
+struct client {
+  int fd;
+  char *input;
+  size_t inputLength;
+  size_t inputSize;
+  char *output;
+  size_t outputLength;
+  size_t outputSent;
+  size_t outputSize;
+  unsigned int events; // Events watched with epoll
+  int num;             // Number of the next command
+  int closing;         // The client is done sending
+  int finished;        // An empty line ended the commands
+  int skippingAcl;     // Lines are ignored up to the end of an ACL
+  int failed;          // The output couldn't grow, results were lost
+};
+
+// Start of a snapshot file, the sections follow in the order of the
+// counts and the strings go last. Sections refer to each other by
+// index, so the file can be mapped anywhere and used as it is
+struct snapshot_header {
+  char magic[8]; // SNAPSHOT_MAGIC
+  uint32_t usersCount;
+  uint32_t groupsCount;
+  uint32_t membershipsCount;
+  uint32_t filesCount;
+  uint32_t aclEntriesCount;
+  uint32_t stringsSize;
+  uint64_t journalSequence; // Last record of the journal it includes
+};
+
+// Users and groups are stored in the order of their ids
+struct snapshot_user {
+  uint32_t name; // Offset of the NUL terminated name in the strings
+  int32_t file;  // -1 if the user has no file
+  uint32_t firstMembership; // Its sorted group ids in the memberships
+  uint32_t membershipsCount;
+};
+
+struct snapshot_group {
+  uint32_t name;
+};
+
+// Parents come before their children, the root is the first file
+struct snapshot_file {
+  int32_t parent; // -1 for the root
+  uint32_t firstAclEntry;
+  uint32_t aclEntriesCount;
+  char cmpName[MAX_CMP_SIZE]; // NUL terminated if it is shorter
+};
+
+struct snapshot_acl_entry {
+  int32_t userId;      // ACL_ANY for "*"
+  int32_t groupId;     // ACL_ANY for "*"
+  int32_t permissions; // ACL_READ and ACL_WRITE bits
+};
+
+// Start of a journal file, records follow one after the other
+struct journal_header {
+  char magic[8]; // JOURNAL_MAGIC
+  uint64_t firstSequence; // Number of the first record
+};
+
+// A record is followed by length bytes of NUL terminated strings
+struct journal_record {
+  uint32_t type;
+  uint32_t length;
+  uint32_t checksum; // hashName of the strings
+};
+
+// Changes to the state kept by the journal, with the strings of each
+enum journal_record_type {
+  J_USER = 1,   // Username
+  J_GROUP,      // Groupname
+  J_MEMBERSHIP, // Username, groupname
+  J_CREATE,     // Path, then user, group and permissions of each ACL
+                // entry with "*" for any
+  J_ACL,        // Same as J_CREATE
+  J_DELETE,     // Path
+};
+
+// Records waiting to be written to the journal file. They are written
+// and synced together before any result is let out, so one sync
+// covers every change made since the last one
+struct journal {
+  int fd; // -1 without a journal
+  char *buffer;
+  size_t length;
+  size_t size;
+  size_t recordStart;     // Where the record being built starts
+  unsigned long sequence; // Number of the last record
+  int recording;          // Set once the journal has been replayed
+  unsigned long records;
+  unsigned long commits;
+};
+
+// Where a file went in a snapshot being saved
+struct file_number {
+  struct file_struct *file;
+  int32_t index;
+};
+
 static struct file_struct *root;
 static struct user_struct *usersHead = NULL;
 static struct group_struct *groupsHead = NULL;
-static struct error_struct error = {1, NULL};
-static char defaultErrorMsg[] = "Error with this entry";
+static struct name_index usersIndex = {NULL, 0};
+static struct name_index groupsIndex = {NULL, 0};
+static int usersCount = 0;
+static int groupsCount = 0;
+static struct path_cache_entry pathCache[PATH_CACHE_SIZE];
+// Entries for existing files are stale once a file is deleted and
+// entries for missing files are stale once a file is created
+static unsigned int pathCacheDeleteGeneration = 1;
+static unsigned int pathCacheCreateGeneration = 1;
+static unsigned long pathCacheHits = 0;
+static unsigned long pathCacheMisses = 0;
+static int printStatsAtExit = 0;
+// Set by --stats and --metrics. Commands are only timed and counted then
+static int collectMetrics = 0;
+static int printMetricsAtExit = 0;
+static volatile sig_atomic_t metricsRequested = 0;
+// Only the main thread records commands, workers leave the time in
+// the queries
+static struct command_metrics commandMetrics[CMD_TYPES];
+static char *commandNames[CMD_TYPES] = {"READ",   "WRITE",  "CREATE",
+                                        "ACL",    "DELETE", "OTHER"};
+// The main thread has the first counters, worker i has the ones at i + 1
+static struct work_counters workCounters[MAX_THREADS];
+static __thread struct work_counters *threadCounters = &workCounters[0];
+// Read memos from older generations are stale. Bumped on ACL changes
+static unsigned int aclGeneration = 1;
+static const struct error_info errors[] = {
+    [E_NONE] = {C_YES, NULL},
+    [E_UNDEFINED_PATH] = {C_INVALID, "Undefined file path"},
+    [E_PATH_START] = {C_INVALID, "File path must start with /"},
+    [E_FILE_CHARACTERS] = {C_INVALID, "Invalid characters in the file name"},
+    [E_COMPONENT_LENGTH] = {C_INVALID, "Component longer than allowed"},
+    [E_PATH_END] = {C_INVALID, "Can't end file path in a /"},
+    [E_DOUBLE_SLASH] =
+        {C_INVALID, "Can't have two consecutive slashes (/) in a file"},
+    [E_PATH_LENGTH] = {C_INVALID, "File name exceeds max file name size"},
+    [E_FILE_EXISTED] = {C_INVALID, "File already existed"},
+    [E_USER_CHARACTERS] = {C_INVALID, "Invalid characters in the user name"},
+    [E_EMPTY_USER] = {C_INVALID, "Empty string supplied for the users"},
+    [E_GROUP_CHARACTERS] = {C_INVALID, "Invalid characters in the group name"},
+    [E_EMPTY_GROUP] = {C_INVALID, "Empty string supplied for the group name"},
+    [E_MISSING_DOT] = {C_INVALID, "Expected . between username and groupname"},
+    [E_MISSING_FIRST_FILE] =
+        {C_INVALID, "The first instance of a user must have a file name"},
+    [E_NOT_FIRST_FILE] =
+        {C_INVALID, "Only the first instance of the user can contain a file"},
+    [E_INVALID_PERMISSIONS] = {C_INVALID, "Invalid permissions"},
+    [E_MISSING_PERMISSIONS] = {C_INVALID, "Missing permissions"},
+    [E_END_OF_FILE] = {C_INVALID, "Unexpected end of file"},
+    [E_NULL_ACL] = {C_INVALID, "The file can't have a NULL ACL"},
+    [E_NO_PARENT] = {C_INVALID, "Parent file does not exist"},
+    [E_FILE_EXISTS] = {C_INVALID, "File already exists"},
+    [E_NO_FILE] = {C_INVALID, "File does not exist"},
+    [E_NO_USER] = {C_INVALID, "User does not exist"},
+    [E_NO_GROUP] = {C_INVALID, "Group does not exist"},
+    [E_NOT_IN_GROUP] = {C_INVALID, "User does not belong to group"},
+    [E_INVALID_COMMAND] = {C_INVALID, "Invalid command"},
+    [E_MISSING_FILE] = {C_INVALID, "You have to include a file name"},
+    [E_CANT_READ] = {C_NO, "Can't read file"},
+    [E_CANT_WRITE] = {C_NO, "No write permissions on this file"},
+    [E_CANT_WRITE_ROOT] = {C_NO, "No write permissions on root file"},
+    [E_HAS_CHILDREN] = {C_NO, "Can't delete a file that has children"},
+    [E_DELETE_ROOT] = {C_NO, "Can't delete the root file"},
+    [E_COMMAND_SIZE] = {C_INVALID, "Command exceeds max command size"},
+};
 static int endOfInput = 0;
+static struct line_reader input = {STDIN_FILENO, NULL, 0, 0, 0, 0, 0};
+static char *keptLine = NULL;
+static size_t keptLineSize = 0;
+static struct output_buffer output;
+static struct pool filePool = {.objectSize = sizeof(struct file_struct)};
+static struct pool aclEntryPool = {.objectSize = sizeof(struct acl_entry)};
+static struct pool userGroupPool = {
+    .objectSize = sizeof(struct user_group_list)};
+static struct pool groupUserPool = {
+    .objectSize = sizeof(struct group_user_list)};
+static struct pool compiledAclPool = {
+    .objectSize = sizeof(struct compiled_acl)};
+static struct pool aclListPool = {.objectSize = sizeof(struct acl_list)};
+static struct pool summaryPool = {
+    .objectSize = sizeof(struct traverse_summary)};
+static struct pool retiredPool = {.objectSize = sizeof(struct retired_object)};
+// Marks the place of a removed child in the children of a file. Its
+// deletedVersion of 0 keeps lookups from ever finding it
+static struct file_struct removedChild;
+// Changes are made with version treeVersion + 1 and become visible to
+// new queries once it is incremented
+static unsigned long treeVersion = 1;
+// Set while worker threads check queries against older versions, so
+// changed objects have to be replaced instead of modified in place
+static int snapshotsInUse = 0;
+static struct retired_object *retiredHead = NULL;
+static struct retired_object *retiredTail = NULL;
+// First retired object that may not be unlinked yet, every one before
+// it is. NULL once all of them are
+static struct retired_object *retiredPending = NULL;
+// Batch i is batches[i % BATCHES_IN_FLIGHT]. The ones from
+// batchesPrinted to batchesDispatched are being checked by the
+// workers, batchesDispatched is the one being filled
+static struct command_batch batches[BATCHES_IN_FLIGHT];
+static unsigned long batchesDispatched = 0;
+static unsigned long batchesPrinted = 0;
+static struct worker workers[MAX_THREADS];
+static int threadsCount = 1;
+static pthread_mutex_t workersLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workReady = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t workDone = PTHREAD_COND_INITIALIZER;
+static int workersStopping = 0;
+static volatile sig_atomic_t serverStopping = 0;
+static struct character_scans characterScans;
+static struct journal journal = {-1, NULL, 0, 0, 0, 0, 0, 0, 0};
+// Last journal record included in the snapshot that was loaded
+static unsigned long snapshotJournalSequence = 0;
 
 /**
- * Function to print debugging messages only if it is in the debugging
- * environmnent
+ * Writes all of the data to STDOUT
  */
-void dbg(char *msg) {
-  if (DEBUGGING) {
-    printf("%s\n", msg);
+void writeAll(char *data, size_t length) {
+  while (length > 0) {
+    ssize_t result = write(STDOUT_FILENO, data, length);
+
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (result < 0) {
+      // Nothing else can be printed, so just give up
+      exit(1);
+    }
+
+    data += result;
+    length -= result;
   }
 }
 
 /**
- * Sets the error message t the global error struct and
- * unsets the read flag.
+ * Prints the strerror for errno straight to STDOUT and exits. For the
+ * errors of the output itself, printAndExit would come back to them
  */
-void setError(char *msg) {
-  if (error.read == 0) {
-    printf("msg %s\n", error.message);
-    dbg("Warning. Setting error without reading prior message");
-  }
+void exitWithErrno() {
+  char *message = strerror(errno);
 
-  error.read = 0;
-  error.message = strdup(msg);
+  writeAll("Error: ", 7);
+  writeAll(message, strlen(message));
+  writeAll("\n", 1);
+  exit(1);
 }
 
 /**
- * Gets the error from the global error struct and
- * sets the read flag. If the error message was
- * already read, a default message is returned instead
+ * Appends the data to the output of the client. If the output can't
+ * grow the data is dropped and the client marked as failed
  */
-char *getError() {
-  if (error.read) {
-    dbg("Warning. Reading error twice (%s)\n");
-    return defaultErrorMsg;
+void appendClientOutput(struct client *client, char *data, size_t length) {
+  size_t size = client->outputSize;
+  char *buffer;
+
+  if (client->failed) {
+    return;
   }
 
-  error.read = 1;
-  return error.message;
-}
+  if (client->outputLength + length > size) {
+    while (client->outputLength + length > size) {
+      size = size ? size * 2 : OUTPUT_BUFFER_SIZE;
+    }
 
-/**
- * Prints an error message if it is passed. It NULL is
- * passed instead, the strerror for errno is printed.
- * After that, the program exits
- */
-void printAndExit(char *msg) {
-  if (msg == NULL) {
-    msg = strerror(errno);
+    buffer = realloc(client->output, size);
+
+    if (buffer == NULL) {
+      client->failed = 1;
+      return;
+    }
+
+    client->output = buffer;
+    client->outputSize = size;
   }
 
-  printf("Error: %s\n", msg);
-  exit(1);
+  memcpy(client->output + client->outputLength, data, length);
+  client->outputLength += length;
 }
 
 /**
- * Validate that the character is a lowercase letter
+ * Writes the records waiting in the journal buffer to the journal file
+ * and syncs it, so every change made so far survives a crash
  */
-int validateOnlyLetter(char c) {
-  if (c < 'a' || c > 'z') {
-    return 0;
+void commitJournal() {
+  size_t written = 0;
+
+  if (journal.length == 0) {
+    return;
   }
 
-  return 1;
+  while (written < journal.length) {
+    ssize_t result = write(journal.fd, journal.buffer + written,
+                           journal.length - written);
+
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (result < 0) {
+      exitWithErrno();
+    }
+
+    written += result;
+  }
+
+  if (fdatasync(journal.fd) != 0) {
+    exitWithErrno();
+  }
+
+  journal.length = 0;
+  journal.commits++;
 }
 
 /**
- * Validates that the character is an uppercase
- * letter
+ * Writes the data to STDOUT or to the client the output is for. The
+ * results may depend on changes in the journal, so it is committed
+ * before they get out
  */
-int validateOnlyUpperCaseLetter(char c) {
-  if (c < 'A' || c > 'Z') {
-    return 0;
+void writeOutputTarget(char *data, size_t length) {
+  if (output.client != NULL) {
+    appendClientOutput(output.client, data, length);
+  } else {
+    commitJournal();
+    writeAll(data, length);
   }
-
-  return 1;
 }
 
 /**
- * Validates if a character is valid in
- * a file name
+ * Writes everything in the output buffer to STDOUT, or to the client
+ * the output is for
  */
-int validateFileChar(char c) {
-  if (validateOnlyLetter(c)) {
-    return 1;
-  }
+void flushOutput() {
+  writeOutputTarget(output.buffer, output.length);
+  output.length = 0;
+}
 
-  if (validateOnlyUpperCaseLetter(c)) {
-    return 1;
+/**
+ * Appends the data to the output buffer, flushing it when it is full
+ */
+void writeOutput(char *data, size_t length) {
+  if (output.length + length > OUTPUT_BUFFER_SIZE) {
+    flushOutput();
   }
 
-  if (c == '.' || c == '/') {
-    return 1;
+  // Too big to buffer, write it directly
+  if (length > OUTPUT_BUFFER_SIZE) {
+    writeOutputTarget(data, length);
+    return;
   }
 
-  return 0;
+  memcpy(output.buffer + output.length, data, length);
+  output.length += length;
 }
 
 /**
- * Searches through a file list looking for the filename.
- * The file is returned if it exist, NULL is returned otherwise
+ * Appends a NUL terminated string to the output buffer
  */
-struct file_struct *findFileInListByName(struct file_struct *file,
-                                         char *cmpName) {
-  struct file_struct *curr = file;
+void writeString(char *string) { writeOutput(string, strlen(string)); }
 
-  while (curr != NULL) {
-    if (strncmp(curr->cmpName, cmpName, MAX_CMP_SIZE) == 0) {
-      return curr;
-    }
+/**
+ * Appends a non negative number in decimal to the output buffer
+ */
+void writeNumber(int number) {
+  char digits[16];
+  int position = sizeof(digits);
 
-    curr = curr->next;
-  }
+  do {
+    digits[--position] = '0' + number % 10;
+    number /= 10;
+  } while (number > 0);
 
-  return NULL;
+  writeOutput(digits + position, sizeof(digits) - position);
 }
 
 /**
- * Adds a file to the list of children of the parent
+ * Ends the current output line. The output is flushed right away if
+ * it is line buffered
  */
-int addChildFile(struct file_struct *parent, struct file_struct *child) {
-  if (findFileInListByName(parent->children, child->cmpName)) {
-    // Shouldn't happen
-    dbg("Error: File name already exists");
-    return 1;
-  }
-
-  child->next = parent->children;
-  parent->children = child;
+void endOutputLine() {
+  writeOutput("\n", 1);
 
-  return 0;
+  if (output.lineBuffered) {
+    flushOutput();
+  }
 }
 
 /**
- * Creates a file and appends it to the children of the parent.
- * The caller is responsible for making sure that the file doesn't
- * exist
+ * Prints the result for a line of input in the format
+ * <number>	<verdict>[	<line>][	<error message>]
+ * line and error are left out when they are NULL
  */
-struct file_struct *createFile(char *cmpName, struct file_struct *parent) {
-  struct file_struct *file = malloc(sizeof(struct file_struct));
+void printResult(int num, char *verdict, char *line, int length,
+                 char *error) {
+  writeNumber(num);
+  writeOutput("\t", 1);
+  writeString(verdict);
+
+  if (line != NULL) {
+    writeOutput("\t", 1);
+    writeOutput(line, length);
+  }
 
-  if (!file) {
-    printAndExit(NULL);
+  if (error != NULL) {
+    writeOutput("\t", 1);
+    writeString(error);
   }
 
-  file->parent = parent;
-  file->next = NULL;
-  file->children = NULL;
-  file->aclHead = NULL;
-  file->aclTail = NULL;
+  endOutputLine();
+}
 
-  strncpy(file->cmpName, cmpName, MAX_CMP_SIZE);
-  file->cmpName[MAX_CMP_SIZE] = '\0';
+/**
+ * Function to print debugging messages only if it is in the debugging
+ * environmnent
+ */
+void dbg(char *msg) {
+  if (DEBUGGING) {
+    flushOutput();
+    printf("%s\n", msg);
+    fflush(stdout);
+  }
+}
 
-  if (parent) {
-    addChildFile(parent, file);
+/**
+ * Prints an error message if it is passed. It NULL is
+ * passed instead, the strerror for errno is printed.
+ * After that, the program exits
+ */
+void printAndExit(char *msg) {
+  if (msg == NULL) {
+    msg = strerror(errno);
   }
 
-  return file;
+  writeString("Error: ");
+  writeString(msg);
+  writeOutput("\n", 1);
+  flushOutput();
+  exit(1);
 }
 
 /**
- * Checks the file path for errors. If it doesn't find errors
- * returns 1. 0 is returned otherwise
+ * Returns an object from the pool. Freed objects are reused first,
+ * otherwise the next object of the current block is handed out and a
+ * new block is allocated when it runs out
  */
-int validateFilePath(char *path) {
-  int last = 0;
-  int cmpLength = 0;
-  char *pathStart = path;
+void *poolAlloc(struct pool *pool) {
+  void *object = pool->freeList;
 
-  if (!path) {
-    setError("Undefined file path");
-    return 0;
-  }
+  pool->allocated++;
 
-  if (*path != '/') {
-    setError("File path must start with /");
-    return 0;
+  if (object != NULL) {
+    pool->freeList = *(void **)object;
+    return object;
   }
 
-  while (*path != '\0') {
-    if (!validateFileChar(*path)) {
-      setError("Invalid characters in the file name");
-      return 0;
+  if (pool->next + pool->objectSize > pool->end) {
+    struct pool_block *block = malloc(POOL_BLOCK_SIZE);
+
+    if (block == NULL) {
+      printAndExit(NULL);
     }
 
-    while (*path != '/') {
-      if (*path == '\0') {
-        last = 1;
-        break;
-      }
+    block->next = pool->blocks;
+    pool->blocks = block;
+    pool->blocksCount++;
+    pool->next = block->objects;
+    pool->end = (char *)block + POOL_BLOCK_SIZE;
+  }
 
-      cmpLength++;
-      path++;
+  object = pool->next;
+  pool->next += pool->objectSize;
 
-      if (cmpLength > MAX_CMP_SIZE) {
-        setError("Component longer than allowed");
-        return 0;
-      }
-    }
+  return object;
+}
 
-    if (last) {
-      break;
-    }
+/**
+ * Returns an object to the free list of its pool
+ */
+void poolFree(struct pool *pool, void *object) {
+  *(void **)object = pool->freeList;
+  pool->freeList = object;
+  pool->freed++;
+}
 
-    cmpLength = 0;
-    path++;
-  }
+/**
+ * Returns the time of the monotonic clock in nanoseconds
+ */
+unsigned long getNanoseconds() {
+  struct timespec now;
 
-  if (cmpLength == 0 && strlen(pathStart) > 1) {
-    setError("Can't end file path in a /");
-    return 0;
-  }
+  clock_gettime(CLOCK_MONOTONIC, &now);
 
-  return 1;
+  return now.tv_sec * 1000000000UL + now.tv_nsec;
 }
 
 /**
- * Performs validation on the file and returns the file
- * if it exists. NULL is returned if there is an error or
- * if the file doesn't exist
+ * Returns the bucket of the histogram the nanoseconds go in
  */
-struct file_struct *findFileByPath(char *pathStart) {
-  char cmpName[MAX_CMP_SIZE + 1];
-  char *path = pathStart;
-  struct file_struct *currentFile = root;
-  int last = 0;
+int getLatencyBucket(unsigned long nanoseconds) {
+  int exponent;
 
-  if (!validateFilePath(pathStart)) {
-    return NULL;
+  if (nanoseconds < 8) {
+    return nanoseconds;
   }
 
-  path++;
+  exponent = 63 - __builtin_clzl(nanoseconds);
 
-  while (*path != '\0') {
-    int cmpLength = 0;
+  return (exponent - 2) * 8 + ((nanoseconds >> (exponent - 3)) & 7);
+}
 
-    while (*path != '/') {
-      if (*path == '\0') {
-        last = 1;
-        break;
-      }
+/**
+ * Returns the smallest number of nanoseconds that goes in the bucket
+ */
+unsigned long getBucketStart(int bucket) {
+  if (bucket < 8) {
+    return bucket;
+  }
 
-      cmpName[cmpLength] = *path;
-      cmpLength++;
-      path++;
+  return (8UL + bucket % 8) << (bucket / 8 - 1);
+}
 
-      if (cmpLength > MAX_CMP_SIZE) {
-        cmpName[MAX_CMP_SIZE] = '\0';
-        dbg("Component longer than allowed");
-      }
-    }
+/**
+ * Counts a command that took the nanoseconds in the histogram
+ */
+void recordLatency(struct latency_histogram *histogram,
+                   unsigned long nanoseconds) {
+  histogram->counts[getLatencyBucket(nanoseconds)]++;
+  histogram->total++;
 
-    cmpName[cmpLength] = '\0';
+  if (nanoseconds > histogram->max) {
+    histogram->max = nanoseconds;
+  }
+}
 
-    currentFile = findFileInListByName(currentFile->children, cmpName);
+/**
+ * Adds the counts of the source histogram to the destination
+ */
+void mergeLatency(struct latency_histogram *destination,
+                  struct latency_histogram *source) {
+  int bucket;
 
-    if (currentFile == NULL) {
-      return NULL;
-    }
+  for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+    destination->counts[bucket] += source->counts[bucket];
+  }
 
-    if (last) {
-      break;
-    }
+  destination->total += source->total;
 
-    path++;
+  if (source->max > destination->max) {
+    destination->max = source->max;
   }
-
-  return currentFile;
 }
 
 /**
- * Creates the ACL entry with the specified permissions. The called is
- * responsible for freeing the
- * memory if needed.
+ * Returns the type of the command named by the text
  */
-struct acl_entry *createAclEntry(char *permissions, struct user_struct *user,
-                                 struct group_struct *group) {
-  int len = strlen(permissions);
-  struct acl_entry *aclEntry = malloc(sizeof(struct acl_entry));
+enum command_type getCommandType(char *command) {
+  int type;
 
-  if (aclEntry == NULL) {
-    printAndExit(NULL);
+  for (type = 0; type < CMD_OTHER; type++) {
+    if (strcmp(command, commandNames[type]) == 0) {
+      return type;
+    }
   }
 
-  aclEntry->next = NULL;
-  aclEntry->group = group;
-  aclEntry->user = user;
-  aclEntry->readPermission = 0;
-  aclEntry->writePermission = 0;
+  return CMD_OTHER;
+}
 
-  if (len == 1) {
-    if (*permissions == 'r') {
-      aclEntry->readPermission = 1;
-    }
+/**
+ * Counts a command of the type that ended with the result and took
+ * the nanoseconds
+ */
+void recordCommand(enum command_type type, enum error_code result,
+                   unsigned long nanoseconds) {
+  commandMetrics[type].verdicts[errors[result].verdict]++;
+  recordLatency(&commandMetrics[type].latency, nanoseconds);
+}
 
-    if (*permissions == 'w') {
-      aclEntry->writePermission = 1;
-    }
+/**
+ * Returns the latency that the percent of the commands in the
+ * histogram didn't go over, rounded up to the end of its bucket but
+ * not past the slowest command
+ */
+unsigned long getLatencyPercentile(struct latency_histogram *histogram,
+                                   int percent) {
+  unsigned long wanted = (histogram->total * percent + 99) / 100;
+  unsigned long seen = 0;
+  unsigned long end;
+  int bucket;
+
+  if (histogram->total == 0) {
+    return 0;
   }
 
-  if (len == 2) {
-    aclEntry->readPermission = 1;
-    aclEntry->writePermission = 1;
+  for (bucket = 0; bucket < LATENCY_BUCKETS - 1; bucket++) {
+    seen += histogram->counts[bucket];
+
+    if (seen >= wanted && seen > 0) {
+      break;
+    }
   }
 
-  return aclEntry;
+  end = getBucketStart(bucket + 1) - 1;
+
+  return end < histogram->max ? end : histogram->max;
 }
 
 /**
- * Matches an ACL entry against a user to see if it matches.
- * Returns 1 if it is a match, 0 otherwise
+ * Frees every block of the pool at once. All of the objects of
+ * the pool become invalid
  */
-int aclUserMatch(struct acl_entry *aclEntry, struct user_struct *user) {
-  // User being NULL is the same as "*" so it matches anything
-  if (aclEntry->user == NULL || aclEntry->user == user) {
-    return 1;
+void releasePool(struct pool *pool) {
+  struct pool_block *block = pool->blocks;
+
+  while (block != NULL) {
+    struct pool_block *temp = block;
+    block = block->next;
+    free(temp);
   }
 
-  return 0;
+  pool->blocks = NULL;
+  pool->next = NULL;
+  pool->end = NULL;
+  pool->freeList = NULL;
+  pool->allocated = 0;
+  pool->freed = 0;
+  pool->blocksCount = 0;
 }
 
 /**
- * Matches an ACL entry against a group to see if it matches.
- * Returns 1 if it is a match, 0 otherwise
+ * Validate that the character is a lowercase letter
  */
-int aclGroupMatch(struct acl_entry *aclEntry, struct group_struct *group) {
-  // Group being NULL is the same as "*" so it matches anything
-  if (aclEntry->group == NULL || aclEntry->group == group) {
-    return 1;
+int validateOnlyLetter(char c) {
+  if (c < 'a' || c > 'z') {
+    return 0;
   }
 
-  return 0;
+  return 1;
 }
 
 /**
- * Finds the ACL entry for a file that matches both the user and the group.
- * The ACL entry is returned if found, NULL is returned otherwise
+ * Validates that the character is an uppercase
+ * letter
  */
-struct acl_entry *findAclByFileUserAndGroup(struct file_struct *file,
-                                            struct user_struct *user,
-                                            struct group_struct *group) {
-  struct acl_entry *aclEntry;
-
-  for (aclEntry = file->aclHead; aclEntry != NULL; aclEntry = aclEntry->next) {
-    if (aclUserMatch(aclEntry, user) && aclGroupMatch(aclEntry, group)) {
-      return aclEntry;
-    }
+int validateOnlyUpperCaseLetter(char c) {
+  if (c < 'A' || c > 'Z') {
+    return 0;
   }
 
-  return NULL;
+  return 1;
 }
 
 /**
- * Adds ACL to the acl list of a file
+ * Validates if a character is valid in
+ * a file name
  */
-void addAclToFile(struct file_struct *file, char *permissions,
-                  struct user_struct *user, struct group_struct *group) {
-  if (findAclByFileUserAndGroup(file, user, group)) {
-    dbg("File already had ACL for that group and user\n");
+int validateFileChar(char c) {
+  if (validateOnlyLetter(c)) {
+    return 1;
   }
 
-  struct acl_entry *aclEntry = createAclEntry(permissions, user, group);
+  if (validateOnlyUpperCaseLetter(c)) {
+    return 1;
+  }
 
-  if (file->aclTail == NULL) {
-    file->aclTail = file->aclHead = aclEntry;
-    return;
+  if (c == '.' || c == '/') {
+    return 1;
   }
 
-  file->aclTail->next = aclEntry;
-  file->aclTail = aclEntry;
+  return 0;
 }
 
 /**
- * Validates the file path. Then starts going component by
- * component verifying if it exists and if it doesn't, it creates
- * it. Returns the last created file if there was no error. NULL
- * is returned otherwise
+ * Returns the first character in [start, end) that is not a lowercase
+ * letter, checking one character at a time
  */
-struct file_struct *addFileByPath(char *pathStart) {
-  char cmpName[MAX_CMP_SIZE + 1];
-  char *path = pathStart;
-  struct file_struct *currentFile = root;
-
-  if (!path) {
-    setError("Undefined file path");
-    return NULL;
+char *skipLettersScalar(char *start, char *end) {
+  while (start != end && validateOnlyLetter(*start)) {
+    start++;
   }
 
-  if (*path != '/') {
-    setError("File path must start with /");
-    return NULL;
-  }
-
-  path++;
-
-  if (strlen(path) > MAX_FILE_NAME_SIZE) {
-    setError("File name exceeds max file name size");
-    return NULL;
-  }
+  return start;
+}
 
-  if (!validateFilePath(pathStart)) {
-    return NULL;
+/**
+ * Returns the first character in [start, end) that can't be in a file
+ * name, checking one character at a time
+ */
+char *skipNameCharactersScalar(char *start, char *end) {
+  while (start != end && *start != '/' && validateFileChar(*start)) {
+    start++;
   }
 
-  while (*path != '\0') {
-    int cmpLength = 0;
-    int last = 0;
-
-    while (*path != '/') {
-      if (*path == '\0') {
-        last = 1;
-        break;
-      }
-
-      cmpName[cmpLength] = *path;
-      cmpLength++;
-      path++;
-
-      if (cmpLength > MAX_CMP_SIZE) {
-        cmpName[MAX_CMP_SIZE] = '\0';
-        setError("Component longer than allowed");
-        return NULL;
-      }
-    }
-
-    cmpName[cmpLength] = '\0';
-
-    struct file_struct *temp =
-        findFileInListByName(currentFile->children, cmpName);
-
-    if (last && temp) {
-      setError("File already existed");
-      return NULL;
-    }
-
-    if (temp) {
-      currentFile = temp;
-    } else {
-      currentFile = createFile(cmpName, currentFile);
+  return start;
+}
 
-      // Add *.* r ACL to files along the path
-      if (!last) {
-        addAclToFile(currentFile, "r", NULL, NULL);
-      }
-    }
+/**
+ * Returns the first character in [start, end) that can't be in a path
+ * or is the second of two slashes, checking one character at a time
+ */
+char *skipPathCharactersScalar(char *start, char *end) {
+  char *line = start;
 
-    if (last) {
+  while (line != end && validateFileChar(*line)) {
+    if (*line == '/' && line != start && line[-1] == '/') {
       break;
     }
 
-    path++;
+    line++;
   }
 
-  return currentFile;
+  return line;
 }
 
+#if defined(__x86_64__)
 /**
- * Searches the user list for a user matching the username. The
- * user is returned if found, NULL is returned otherwise.
+ * Returns a bit for each of the 16 characters, set if it is a
+ * lowercase letter
  */
-struct user_struct *findUserByUsername(char *username) {
-  struct user_struct *window = usersHead;
+unsigned int letterMaskSse2(__m128i chunk) {
+  // Moves the letters to the 26 smallest signed values
+  __m128i shifted = _mm_add_epi8(chunk, _mm_set1_epi8(128 - 'a'));
 
-  while (window != NULL) {
-    if (strcmp(username, window->username) == 0) {
-      return window;
-    }
+  return _mm_movemask_epi8(_mm_cmplt_epi8(shifted, _mm_set1_epi8(-128 + 26)));
+}
 
-    window = window->next;
-  }
+/**
+ * Returns a bit for each of the 16 characters, set if it can be in a
+ * file name
+ */
+unsigned int nameMaskSse2(__m128i chunk) {
+  // Setting 0x20 makes uppercase letters lowercase and turns nothing
+  // else into a letter
+  __m128i folded = _mm_or_si128(chunk, _mm_set1_epi8(0x20));
+  __m128i dots = _mm_cmpeq_epi8(chunk, _mm_set1_epi8('.'));
 
-  return NULL;
+  return letterMaskSse2(folded) | _mm_movemask_epi8(dots);
 }
 
 /**
- * Searches the group list for a group matching the groupname. The
- * group is returned if found, NULL is returned otherwise.
+ * skipLettersScalar 16 characters at a time
  */
-struct group_struct *findGroupByGroupname(char *groupname) {
-  struct group_struct *window = groupsHead;
+char *skipLettersSse2(char *start, char *end) {
+  unsigned int stops;
 
-  while (window != NULL) {
-    if (strcmp(groupname, window->groupname) == 0) {
-      return window;
-    }
+  for (; end - start >= 16; start += 16) {
+    stops = ~letterMaskSse2(_mm_loadu_si128((__m128i *)start)) & 0xffff;
 
-    window = window->next;
+    if (stops != 0) {
+      return start + __builtin_ctz(stops);
+    }
   }
 
-  return NULL;
+  return skipLettersScalar(start, end);
 }
 
 /**
- * Creates a user if it doesn't exist. The called should make
- * sure the user doesn't exist before calling this function
+ * skipNameCharactersScalar 16 characters at a time
  */
-struct user_struct *createUser(char *username) {
-  struct user_struct *user = findUserByUsername(username);
-
-  if (user != NULL) {
-    // Should never happen
-    printAndExit("User already exists.");
-  }
+char *skipNameCharactersSse2(char *start, char *end) {
+  unsigned int stops;
 
-  user = malloc(sizeof(struct user_struct));
+  for (; end - start >= 16; start += 16) {
+    stops = ~nameMaskSse2(_mm_loadu_si128((__m128i *)start)) & 0xffff;
 
-  if (user == NULL) {
-    printAndExit(NULL);
+    if (stops != 0) {
+      return start + __builtin_ctz(stops);
+    }
   }
 
-  user->username = strdup(username);
-  user->next = usersHead;
-  user->groups = NULL;
-  user->file = NULL;
-
-  usersHead = user;
-
-  return user;
+  return skipNameCharactersScalar(start, end);
 }
 
 /**
- * Creats a group if it doesn't exist. The caller should
- * make sure the group doesn't exist before calling this
- * function
+ * skipPathCharactersScalar 16 characters at a time
  */
-struct group_struct *createGroup(char *groupname) {
-  struct group_struct *group = findGroupByGroupname(groupname);
+char *skipPathCharactersSse2(char *start, char *end) {
+  char *line = start;
+  unsigned int previousSlash = 0;
+  unsigned int slashes;
+  unsigned int stops;
+  __m128i chunk;
+
+  for (; end - line >= 16; line += 16) {
+    chunk = _mm_loadu_si128((__m128i *)line);
+    slashes = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('/')));
+    stops = ~(nameMaskSse2(chunk) | slashes) & 0xffff;
+    stops |= slashes & (slashes << 1 | previousSlash);
+
+    if (stops != 0) {
+      return line + __builtin_ctz(stops);
+    }
 
-  if (group != NULL) {
-    printAndExit("Group already exists");
+    previousSlash = slashes >> 15;
   }
 
-  group = malloc(sizeof(struct group_struct));
+  // Starting at the last character checked still finds a second slash
+  // right after it
+  return skipPathCharactersScalar(line == start ? line : line - 1, end);
+}
 
-  if (group == NULL) {
-    printAndExit(NULL);
-  }
+/**
+ * Returns a bit for each of the 32 characters, set if it is a
+ * lowercase letter
+ */
+__attribute__((target("avx2"))) unsigned int letterMaskAvx2(__m256i chunk) {
+  __m256i shifted = _mm256_add_epi8(chunk, _mm256_set1_epi8(128 - 'a'));
+  __m256i limit = _mm256_set1_epi8(-128 + 26);
 
-  group->groupname = strdup(groupname);
-  group->next = groupsHead;
-  group->users = NULL;
+  return _mm256_movemask_epi8(_mm256_cmpgt_epi8(limit, shifted));
+}
 
-  groupsHead = group;
+/**
+ * Returns a bit for each of the 32 characters, set if it can be in a
+ * file name
+ */
+__attribute__((target("avx2"))) unsigned int nameMaskAvx2(__m256i chunk) {
+  __m256i folded = _mm256_or_si256(chunk, _mm256_set1_epi8(0x20));
+  __m256i dots = _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('.'));
 
-  return group;
+  return letterMaskAvx2(folded) | _mm256_movemask_epi8(dots);
 }
 
 /**
- * Finds a group in the list of groups in the user. Returns the group if it
- * finds it, NULL otherwise
+ * skipLettersScalar 32 characters at a time
  */
-struct group_struct *findUserGroup(struct user_struct *user, char *groupname) {
-  struct user_group_list *userGroupContainer = user->groups;
+__attribute__((target("avx2"))) char *skipLettersAvx2(char *start,
+                                                       char *end) {
+  unsigned int stops;
 
-  while (userGroupContainer != NULL) {
-    struct group_struct *group = userGroupContainer->group;
+  for (; end - start >= 32; start += 32) {
+    stops = ~letterMaskAvx2(_mm256_loadu_si256((__m256i *)start));
 
-    if (strcmp(group->groupname, groupname) == 0) {
-      return group;
+    if (stops != 0) {
+      return start + __builtin_ctz(stops);
     }
-
-    userGroupContainer = userGroupContainer->next;
   }
 
-  return NULL;
+  return skipLettersScalar(start, end);
 }
 
 /**
- * Finds a user inside a group if it exists, returns the user,
- * NULL is returned otherwise
+ * skipNameCharactersScalar 32 characters at a time
  */
-struct user_struct *findGroupUser(struct group_struct *group, char *username) {
-  struct group_user_list *groupUserContainer = group->users;
+__attribute__((target("avx2"))) char *skipNameCharactersAvx2(char *start,
+                                                              char *end) {
+  unsigned int stops;
 
-  while (groupUserContainer != NULL) {
-    struct user_struct *user = groupUserContainer->user;
+  for (; end - start >= 32; start += 32) {
+    stops = ~nameMaskAvx2(_mm256_loadu_si256((__m256i *)start));
 
-    if (strcmp(user->username, username) == 0) {
-      return user;
+    if (stops != 0) {
+      return start + __builtin_ctz(stops);
     }
-
-    groupUserContainer = groupUserContainer->next;
   }
 
-  return NULL;
+  return skipNameCharactersScalar(start, end);
 }
 
 /**
- * Adds the user to the list in the group and adds the
- * group to the list of groups for the user (if necessary).
+ * skipPathCharactersScalar 32 characters at a time
  */
-void addUserToGroup(struct user_struct *user, struct group_struct *group) {
-  struct group_struct *userGroup = findUserGroup(user, group->groupname);
-  struct user_struct *groupUser = findGroupUser(group, user->username);
-
-  if (userGroup == NULL) {
-    struct user_group_list *userGroupContainer =
-        malloc(sizeof(struct user_group_list));
-
-    if (userGroupContainer == NULL) {
-      printAndExit(NULL);
+__attribute__((target("avx2"))) char *skipPathCharactersAvx2(char *start,
+                                                              char *end) {
+  char *line = start;
+  unsigned int previousSlash = 0;
+  unsigned int slashes;
+  unsigned int stops;
+  __m256i chunk;
+
+  for (; end - line >= 32; line += 32) {
+    chunk = _mm256_loadu_si256((__m256i *)line);
+    slashes = _mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('/')));
+    stops = ~(nameMaskAvx2(chunk) | slashes);
+    stops |= slashes & (slashes << 1 | previousSlash);
+
+    if (stops != 0) {
+      return line + __builtin_ctz(stops);
     }
 
-    userGroupContainer->group = group;
-    userGroupContainer->next = user->groups;
-    user->groups = userGroupContainer;
+    previousSlash = slashes >> 31;
   }
 
-  if (groupUser == NULL) {
-    struct group_user_list *groupUserContainer =
-        malloc(sizeof(struct group_user_list));
-
-    if (groupUserContainer == NULL) {
-      printAndExit(NULL);
-    }
-
-    groupUserContainer->user = user;
-    groupUserContainer->next = group->users;
-    group->users = groupUserContainer;
-  }
+  return skipPathCharactersScalar(line == start ? line : line - 1, end);
 }
+#endif
 
 /**
- * Creates the user and group if they don't exist. Then adds
- * the user to the group.
+ * Picks the character scans called name, or the fastest ones the CPU
+ * can run if name is NULL
  */
-int addUserAndGroup(char *username, char *groupname) {
-  struct user_struct *user = findUserByUsername(username);
-  struct group_struct *group = findGroupByGroupname(groupname);
-
-  if (user == NULL) {
-    user = createUser(username);
+void selectCharacterScans(char *name) {
+  struct character_scans scans[3];
+  int count = 0;
+  int i;
+
+  scans[count++] = (struct character_scans){
+      "scalar", skipLettersScalar, skipNameCharactersScalar,
+      skipPathCharactersScalar};
+
+#if defined(__x86_64__)
+  // Every x86-64 CPU has SSE2
+  scans[count++] = (struct character_scans){
+      "sse2", skipLettersSse2, skipNameCharactersSse2,
+      skipPathCharactersSse2};
+
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2")) {
+    scans[count++] = (struct character_scans){
+        "avx2", skipLettersAvx2, skipNameCharactersAvx2,
+        skipPathCharactersAvx2};
   }
+#endif
 
-  if (group == NULL) {
-    group = createGroup(groupname);
+  if (name == NULL) {
+    characterScans = scans[count - 1];
+    return;
   }
 
-  addUserToGroup(user, group);
+  for (i = 0; i < count; i++) {
+    if (strcmp(scans[i].name, name) == 0) {
+      characterScans = scans[i];
+      return;
+    }
+  }
 
-  return 0;
+  printAndExit("The character scans must be scalar, sse2 or avx2 and "
+               "run on this CPU");
 }
 
 /**
- * Gets the username from the line. The caller is responsible
- * for freeing the memory in *username.
- * Returns the position after the username ends (should be ""*)
+ * Hashes a user or group name or a path (FNV-1a)
  */
-char *getUsername(char *userStart, char **username) {
-  char *line = userStart;
-  char c;
-  int len = 0;
-
-  // Get user name
-  while ((c = *line) != '.') {
-    if (!validateOnlyLetter(c)) {
-      setError("Invalid characters in the user name");
-      return NULL;
-    }
+unsigned int hashName(char *name, size_t length) {
+  unsigned int hash = 2166136261u;
+  size_t i;
 
-    len++;
-    line++;
+  for (i = 0; i < length; i++) {
+    hash ^= (unsigned char)name[i];
+    hash *= 16777619u;
   }
 
-  if (!len) {
-    setError("Empty string supplied for the users");
-    return NULL;
-  }
+  return hash;
+}
 
-  *username = strndup(userStart, len);
+/**
+ * Makes the key of a file name. Only the first MAX_CMP_SIZE characters
+ * are kept since that is all a file keeps of its name
+ */
+void makeComponentKey(char *name, size_t length, struct component_key *key) {
+  if (length > MAX_CMP_SIZE) {
+    length = MAX_CMP_SIZE;
+  }
 
-  return line;
+  key->words[0] = 0;
+  key->words[1] = 0;
+  memcpy(key->words, name, length);
+  key->length = length;
+  key->hash = hashName(name, length);
 }
 
 /**
- * Gets the groupname from the line. The caller is responsible for
- * freeing the memory in *groupname
- * Returns the position after the groupname ends
+ * Returns the name of the key. It is only NUL terminated if it is
+ * shorter than MAX_CMP_SIZE, print it with key->length
  */
-char *getGroupname(char *groupStart, char **groupname) {
-  char *line = groupStart;
-  char c;
-  int len = 0;
-
-  // Get group name
-  while ((c = *line) != ' ') {
-    if (c == '\0') {
-      break;
-    }
+char *getComponentName(struct component_key *key) {
+  return (char *)key->words;
+}
 
-    if (!validateOnlyLetter(c)) {
-      setError("Invalid characters in the group name");
-      return NULL;
+/**
+ * Appends the data to the record being built in the journal buffer
+ */
+void appendJournalData(void *data, size_t length) {
+  if (journal.length + length > journal.size) {
+    while (journal.length + length > journal.size) {
+      journal.size = journal.size ? journal.size * 2 : JOURNAL_BUFFER_SIZE;
     }
 
-    len++;
-    line++;
-  }
+    journal.buffer = realloc(journal.buffer, journal.size);
 
-  if (!len) {
-    setError("Empty string supplied for the group name");
-    return NULL;
+    if (journal.buffer == NULL) {
+      printAndExit(NULL);
+    }
   }
 
-  *groupname = strndup(groupStart, len);
+  memcpy(journal.buffer + journal.length, data, length);
+  journal.length += length;
+}
 
-  return line;
+/**
+ * Appends the string with its NUL to the record being built
+ */
+void appendJournalString(char *string) {
+  appendJournalData(string, strlen(string) + 1);
 }
 
 /**
- * Gets username and groupname from the line. The caller is
- * responsible for freeing the memory for the *username and *groupname
- * Returns the position of the line after the groupname ends
+ * Starts a record of the type in the journal buffer
  */
-char *getUsernameAndGroupname(char *userStart, char **username,
-                              char **groupname) {
-  char *line = userStart;
+void beginJournalRecord(enum journal_record_type type) {
+  struct journal_record record = {type, 0, 0};
 
-  line = getUsername(line, username);
+  journal.recordStart = journal.length;
+  appendJournalData(&record, sizeof(record));
+}
 
-  if (line == NULL) {
-    return NULL;
-  }
+/**
+ * Fills in the length and checksum of the record being built. Once
+ * the buffer is full the records are committed without waiting for
+ * the next result to get out
+ */
+void endJournalRecord() {
+  struct journal_record record;
+  char *payload = journal.buffer + journal.recordStart + sizeof(record);
 
-  line++;
+  // Records are packed, so the buffer may not be aligned for them
+  memcpy(&record, journal.buffer + journal.recordStart, sizeof(record));
+  record.length = journal.length - journal.recordStart - sizeof(record);
+  record.checksum = hashName(payload, record.length);
+  memcpy(journal.buffer + journal.recordStart, &record, sizeof(record));
 
-  line = getGroupname(line, groupname);
+  journal.sequence++;
+  journal.records++;
 
-  if (line == NULL) {
-    free(*username);
-    return NULL;
+  if (journal.length >= JOURNAL_BUFFER_SIZE) {
+    commitJournal();
   }
-
-  return line;
 }
 
 /**
- * Gets the username and groupname. It is different from
- * getUsernameAndGroupname that it allows username and
- * groupname to be "*"
+ * Records a change that takes one or two names in the journal
  */
-char *getUsernameAndGroupnameForAcl(char *userStart, char **username,
-                                    char **groupname) {
-  char *line = userStart;
+void journalNames(enum journal_record_type type, char *name,
+                  char *otherName) {
+  beginJournalRecord(type);
+  appendJournalString(name);
 
-  if (*userStart == '*') {
-    *username = strdup("*");
+  if (otherName != NULL) {
+    appendJournalString(otherName);
+  }
 
-    if (username == NULL) {
-      printAndExit(NULL);
-    }
+  endJournalRecord();
+}
 
-    line++;
-  } else {
-    line = getUsername(line, username);
+/**
+ * Returns 1 if the file exists in the version of the tree, 0 otherwise
+ */
+int isFileVisible(struct file_struct *file, unsigned long version) {
+  return file->createdVersion <= version &&
+         loadShared(&file->deletedVersion) > version;
+}
 
-    if (line == NULL) {
-      return NULL;
+/**
+ * Returns 1 if the file has the name of the key, 0 otherwise. Names
+ * have no NULs, so the padding tells names of different lengths apart
+ */
+int isNamedBy(struct file_struct *file, struct component_key *key) {
+  return file->key.hash == key->hash &&
+         file->key.words[0] == key->words[0] &&
+         file->key.words[1] == key->words[1];
+}
+
+/**
+ * Searches the children of the file as they were at the version
+ * looking for the name of the key. The file is returned if it exist,
+ * NULL is returned otherwise
+ */
+struct file_struct *findChildByName(struct file_struct *parent,
+                                    struct component_key *key,
+                                    unsigned long version) {
+  struct children_index *index = loadShared(&parent->childrenIndex);
+  unsigned int hash = key->hash;
+  struct file_struct *child;
+  unsigned int count;
+  unsigned int i;
+
+  if (index != NULL) {
+    unsigned int mask = index->size - 1;
+    unsigned int position = hash & mask;
+
+    // Deleted files stay until they are reclaimed, so a name can be
+    // there more than once. Only one of them is visible
+    while ((child = loadShared(&index->slots[position])) != NULL) {
+      countWork(childrenScanned, 1);
+
+      if (isNamedBy(child, key) && isFileVisible(child, version)) {
+        return child;
+      }
+
+      position = (position + 1) & mask;
     }
-  }
 
-  if (*line != '.') {
-    setError("Expected . between username and groupname");
     return NULL;
   }
 
-  line++;
-
-  if (*line == '*') {
-    *groupname = strdup("*");
-
-    if (groupname == NULL) {
-      printAndExit(NULL);
-    }
+  count = loadShared(&parent->inlineChildrenCount);
 
-    line++;
-  } else {
-    line = getGroupname(line, groupname);
+  for (i = 0; i < count; i++) {
+    child = loadShared(&parent->inlineChildren[i]);
+    countWork(childrenScanned, 1);
 
-    if (line == NULL) {
-      return NULL;
+    if (isNamedBy(child, key) && isFileVisible(child, version)) {
+      return child;
     }
   }
 
-  return line;
+  return NULL;
 }
 
 /**
- * Extracts the file path from the line and puts it
- * in filePath. The caller is responsible for freeing
- * *filePath.
- * Returns the position where the filePath ends or
- * NULL if there was an error.
+ * Puts the child in the first free slot of its probe sequence. Slots
+ * of removed children are reused
  */
-char *getFilepath(char *line, char **filePath) {
-  int len = 0;
-  char *filePathStart = line;
-  char c;
-  char *lastSlash;
+void insertChildIndexSlot(struct children_index *index,
+                          struct file_struct *child) {
+  unsigned int mask = index->size - 1;
+  unsigned int position = child->key.hash & mask;
+  struct file_struct *slot;
+
+  while ((slot = index->slots[position]) != NULL && slot != &removedChild) {
+    position = (position + 1) & mask;
+  }
 
-  if (*filePathStart != '/') {
-    setError("File path must start with /");
-    return NULL;
+  if (slot == NULL) {
+    index->used++;
   }
 
-  lastSlash = filePathStart;
+  index->count++;
+  storeShared(&index->slots[position], child);
+}
 
-  // Get file
-  while ((c = *line) != '\0') {
+/**
+ * Removes the child from the lookup of its parent, readers that are
+ * probing don't notice it
+ */
+void removeChildFromIndex(struct file_struct *parent,
+                          struct file_struct *child) {
+  struct children_index *index = parent->childrenIndex;
+  unsigned int mask;
+  unsigned int position;
+  unsigned int i;
+
+  if (index == NULL) {
+    for (i = 0; parent->inlineChildren[i] != child; i++)
+      ;
+
+    storeShared(&parent->inlineChildren[i], &removedChild);
+    return;
+  }
 
-    if (!validateFileChar(c)) {
-      setError("Invalid characters in the file name");
-      return NULL;
-    }
+  mask = index->size - 1;
+  position = child->key.hash & mask;
 
-    len++;
-    line++;
+  while (index->slots[position] != child) {
+    position = (position + 1) & mask;
+  }
 
-    if (*line == '/') {
-      if (line - lastSlash < 2) {
-        setError("Can't have two consecutive slashes (/) in a file");
-        return NULL;
-      }
+  index->count--;
+  storeShared(&index->slots[position], &removedChild);
+}
 
-      lastSlash = line;
-    }
-  }
+/**
+ * Returns a new empty compiled ACL for the next version of the tree.
+ * older is the one that the versions before it use
+ */
+struct compiled_acl *createCompiledAcl(struct compiled_acl *older) {
+  struct compiled_acl *compiledAcl = poolAlloc(&compiledAclPool);
+
+  compiledAcl->rules = NULL;
+  compiledAcl->count = 0;
+  compiledAcl->size = 0;
+  compiledAcl->hasFallback = 0;
+  compiledAcl->fallback = 0;
+  compiledAcl->version = treeVersion + 1;
+  compiledAcl->older = older;
+  compiledAcl->references = 1;
+
+  return compiledAcl;
+}
 
-  if (len > MAX_FILE_NAME_SIZE) {
-    setError("File name exceeds max file name size");
-    return NULL;
+/**
+ * Drops a reference to the compiled ACL. The last one frees it and its
+ * rules
+ */
+void releaseCompiledAcl(struct compiled_acl *compiledAcl) {
+  if (--compiledAcl->references > 0) {
+    return;
   }
 
-  *filePath = strndup(filePathStart, len);
-
-  return line;
+  free(compiledAcl->rules);
+  poolFree(&compiledAclPool, compiledAcl);
 }
 
 /**
- * Gets user, group and file from the line, validates
- * them and creates them, if necessary.
- * Returns
- *	U_VALID If the line is valid
- * 	U_INVALID If the line was not valid
+ * Returns a new empty ACL list
  */
-int parseUserDefinitionLine(char *line) {
-  char *filePathStart;
-  char *fileName = NULL;
-  struct user_struct *user;
-  struct group_struct *group;
-  struct user_struct *possibleUser;
-  struct file_struct *file;
-  char *username;
-  char *groupname;
-  int len = 0;
+struct acl_list *createAclList() {
+  struct acl_list *acl = poolAlloc(&aclListPool);
 
-  line = getUsernameAndGroupname(line, &username, &groupname);
+  acl->head = NULL;
+  acl->tail = NULL;
+  acl->references = 1;
 
-  // An error ocurred
-  if (line == NULL) {
-    return U_INVALID;
-  }
-
-  possibleUser = findUserByUsername(username);
+  return acl;
+}
 
-  // Means no file specified and first time we see the user
-  if (*line != ' ' && possibleUser == NULL) {
-    free(groupname);
-    free(username);
+/**
+ * Clears the ACL list and frees the memory
+ */
+void clearAclList(struct acl_entry *aclEntryHead) {
+  struct acl_entry *aclEntry = aclEntryHead;
 
-    setError("The first instance of a user must have a file name");
-    return U_INVALID;
+  while (aclEntry != NULL) {
+    struct acl_entry *temp = aclEntry;
+    aclEntry = aclEntry->next;
+    poolFree(&aclEntryPool, temp);
   }
+}
 
-  // Means no file specified but it is ot the first time we see the user
-  if (*line != ' ') {
-    addUserAndGroup(username, groupname);
-    user = findUserByUsername(username);
-    group = findGroupByGroupname(groupname);
+/**
+ * Drops the reference of the file to its ACL list. The last one frees
+ * the entries
+ */
+void clearAclForFile(struct file_struct *file) {
+  struct acl_list *acl = file->acl;
 
-    addAclToFile(user->file, "rw", user, group);
+  file->acl = NULL;
 
-    return U_VALID;
+  if (--acl->references > 0) {
+    return;
   }
 
-  // Skip ' '
-  line++;
-  line = getFilepath(line, &filePathStart);
+  clearAclList(acl->head);
+  poolFree(&aclListPool, acl);
+}
 
-  // Error with the file. Error msg is already set
-  if (line == NULL) {
-    free(groupname);
-    free(username);
+/**
+ * Makes the file inherit the ACL of another file. They share its
+ * entries and compiled form, nothing is copied. dst must be a file no
+ * query can see yet
+ */
+void copyAcl(struct file_struct *dst, struct file_struct *src) {
+  clearAclForFile(dst);
+  releaseCompiledAcl(dst->compiledAcl);
 
-    return U_INVALID;
-  }
+  dst->acl = src->acl;
+  dst->acl->references++;
+  src->compiledAcl->references++;
+  storeShared(&dst->compiledAcl, src->compiledAcl);
+}
 
-  len = strlen(filePathStart);
+/**
+ * Frees a deleted file. Its older compiled ACLs are already freed
+ */
+void freeFile(struct file_struct *file) {
+  releaseCompiledAcl(file->compiledAcl);
+  free(file->childrenIndex);
 
-  // Means file specified but it is not the first time we see the user
-  if (len && possibleUser != NULL) {
-    free(groupname);
-    free(username);
-    setError("Only the first instance of the user can contain a file");
-    return U_INVALID;
+  if (file->summary != NULL) {
+    poolFree(&summaryPool, file->summary);
   }
 
-  // Means no file specified but it is the first time we see the user
-  if (!len && possibleUser == NULL) {
-    free(groupname);
-    free(username);
-
-    setError("The first instance of a user must have a file name");
-    return U_INVALID;
-  }
+  poolFree(&filePool, file);
+}
 
-  fileName = strndup(filePathStart, len);
-  file = addFileByPath(fileName);
+/**
+ * Returns the oldest version that a query waiting to be checked or
+ * any query still to come can be checked against
+ */
+unsigned long getOldestQueryVersion() {
+  unsigned long oldest = treeVersion;
+  unsigned long i;
 
-  // Error creating the file. Error msg is already set
-  if (file == NULL) {
-    free(groupname);
-    free(username);
-    return U_INVALID;
+  if (!snapshotsInUse) {
+    return VERSION_NEVER;
   }
 
-  addUserAndGroup(username, groupname);
-  user = findUserByUsername(username);
-  group = findGroupByGroupname(groupname);
-
-  user->file = file;
-
-  addAclToFile(user->file, "rw", user, group);
+  for (i = batchesPrinted; i <= batchesDispatched; i++) {
+    struct command_batch *batch = &batches[i % BATCHES_IN_FLIGHT];
 
-  if (fileName != NULL) {
-    free(fileName);
+    if (batch->count > 0 && batch->oldestVersion < oldest) {
+      oldest = batch->oldestVersion;
+    }
   }
 
-  free(groupname);
-  free(username);
-
-  return U_VALID;
+  return oldest;
 }
 
 /**
- * Creates the root folder along with /tmp and /home and
- * gives them the ACL
+ * Makes the retired object unreachable. Workers may still be using it
+ * for queries they started before
  */
-int initFs() {
-  root = createFile("/", NULL);
+void unlinkRetired(struct retired_object *retired) {
+  if (retired->kind == RETIRED_FILE) {
+    struct file_struct *file = retired->object;
 
-  struct file_struct *tmp = createFile("tmp", root);
-  struct file_struct *home = createFile("home", root);
-
-  addAclToFile(root, "r", NULL, NULL);
-  addAclToFile(tmp, "rw", NULL, NULL);
-  addAclToFile(home, "r", NULL, NULL);
+    removeChildFromIndex(file->parent, file);
+  } else if (retired->link != NULL) {
+    storeShared(retired->link, NULL);
+  }
 
-  return 0;
+  retired->unlinked = 1;
+  retired->unlinkedBatch = batchesDispatched;
 }
 
 /**
- * Gets a line from STDIN. The caller is responsible for
- * freeing the memory of the line. If it reaches the end
- * of input, the endOfInput global variable is set
+ * Frees the retired object
  */
-char *getLine() {
-  int len = INITIAL_LINE_SIZE;
-  int index = 0;
-  char *line = malloc(len);
-  char *returnLine;
-  char c;
-
-  if (line == NULL) {
-    printAndExit(NULL);
+void freeRetired(struct retired_object *retired) {
+  if (retired->kind == RETIRED_FILE) {
+    freeFile(retired->object);
+  } else if (retired->kind == RETIRED_ACL) {
+    releaseCompiledAcl(retired->object);
+  } else {
+    free(retired->object);
   }
+}
 
-  while ((c = getchar()) != EOF && c != '\n') {
-    line[index] = c;
-    index++;
+/**
+ * Unlinks the retired objects that no query needs anymore and frees
+ * the unlinked ones that no worker can be reading. Both happen in the
+ * order they were retired, so a newer version is never freed before
+ * the link to the older one is cleared
+ */
+void reclaimRetired() {
+  unsigned long oldest = getOldestQueryVersion();
+  struct retired_object *retired;
+
+  // Starts past the ones already unlinked, so every object is only
+  // gone over once
+  while (retiredPending != NULL) {
+    if (!retiredPending->unlinked) {
+      if (retiredPending->version > oldest) {
+        break;
+      }
 
-    if (index > len - 1) {
-      len *= 2;
-      line = realloc(line, len);
+      unlinkRetired(retiredPending);
     }
-  }
 
-  if (c == EOF) {
-    endOfInput = 1;
+    retiredPending = retiredPending->next;
   }
 
-  line[index] = '\0';
+  // Every batch dispatched before the unlink has to be done. This stops
+  // before retiredPending, which is not unlinked
+  while (retiredHead != NULL && retiredHead->unlinked &&
+         retiredHead->unlinkedBatch <= batchesPrinted) {
+    retired = retiredHead;
+    retiredHead = retired->next;
+    freeRetired(retired);
+    poolFree(&retiredPool, retired);
+  }
 
-  returnLine = strndup(line, index);
+  if (retiredHead == NULL) {
+    retiredTail = NULL;
+  }
+}
 
-  if (returnLine == NULL) {
-    printAndExit(NULL);
+/**
+ * Hands an object that queries from before the version may still use
+ * over to be freed when it is safe. link is where the newer version
+ * points to it, it is cleared once no query needs the object. Without
+ * worker threads that is right away
+ */
+void retireObject(void *object, enum retired_kind kind,
+                  unsigned long version, void **link) {
+  struct retired_object *retired = poolAlloc(&retiredPool);
+
+  retired->next = NULL;
+  retired->kind = kind;
+  retired->object = object;
+  retired->link = link;
+  retired->version = version;
+  // Nothing points to those anymore
+  retired->unlinked = kind == RETIRED_MEMORY;
+  retired->unlinkedBatch = batchesDispatched;
+
+  if (retiredTail != NULL) {
+    retiredTail->next = retired;
+  } else {
+    retiredHead = retired;
   }
 
-  free(line);
+  retiredTail = retired;
+
+  if (retiredPending == NULL) {
+    retiredPending = retired;
+  }
 
-  return returnLine;
+  reclaimRetired();
 }
 
 /**
- * Goes through all the files belonging to users adding
- * read permissions for everybody at the end of the ACL.
- * This is done to allow another user to own a file inside
- * another user's file
+ * Replaces the children index of the file with a new one that has
+ * room for more children. Removed children are left out
  */
-void addReadPermissionToUserFiles() {
-  struct user_struct *window = usersHead;
+void rebuildChildrenIndex(struct file_struct *parent) {
+  struct children_index *oldIndex = parent->childrenIndex;
+  struct children_index *index;
+  struct file_struct **children;
+  unsigned int slots; // Slots of the old children to go over
+  unsigned int count; // Children that are not removed
+  unsigned int size = INITIAL_CHILDREN_INDEX_SIZE;
+  unsigned int i;
+
+  if (oldIndex != NULL) {
+    children = oldIndex->slots;
+    slots = oldIndex->size;
+    count = oldIndex->count;
+  } else {
+    children = parent->inlineChildren;
+    slots = parent->inlineChildrenCount;
+    count = parent->inlineChildrenCount;
+  }
 
-  while (window != NULL) {
-    struct file_struct *file = window->file;
+  // Leave the load factor at about 1/4 so rebuilds are rare. A full
+  // index with no removed children doubles
+  while (size < count * 4) {
+    size *= 2;
+  }
 
-    if (file != NULL) {
-      addAclToFile(file, "r", NULL, NULL);
+  index = calloc(1, sizeof(struct children_index) +
+                        size * sizeof(struct file_struct *));
+
+  if (index == NULL) {
+    printAndExit(NULL);
+  }
+
+  index->size = size;
+
+  for (i = 0; i < slots; i++) {
+    if (children[i] != NULL && children[i] != &removedChild) {
+      insertChildIndexSlot(index, children[i]);
     }
+  }
 
-    window = window->next;
+  storeShared(&parent->childrenIndex, index);
+
+  if (oldIndex != NULL) {
+    retireObject(oldIndex, RETIRED_MEMORY, 0, NULL);
   }
 }
 
 /**
- * Parses the user definition section line by line and
- * initializes the users, groups and files. This
- * function runs until a single line with a "." is found
- * denoting the end of the user definition section
+ * Adds a file to the children of the parent
  */
-int parseUserDefinitionSection() {
-  char *line;
-  int num = 1;
-  int result;
-  char *error;
-
-  while (1) {
-    line = getLine();
+int addChildFile(struct file_struct *parent, struct file_struct *child) {
+  struct children_index *index = parent->childrenIndex;
 
-    if (endOfInput) {
-      free(line);
-      break;
-    }
+  if (findChildByName(parent, &child->key, VERSION_LATEST)) {
+    // Shouldn't happen
+    dbg("Error: File name already exists");
+    return 1;
+  }
 
-    if (strcmp(line, ".") == 0) {
-      free(line);
-      break;
-    }
+  child->prev = NULL;
+  child->next = parent->children;
 
-    result = parseUserDefinitionLine(line);
+  if (parent->children != NULL) {
+    parent->children->prev = child;
+  }
 
-    if (result == U_VALID) {
-      printf("%d\tY\n", num);
-    } else {
-      error = getError();
-      printf("%d\tX\t%s\n", num, error);
-    }
+  parent->children = child;
 
-    num++;
+  if (index == NULL && parent->inlineChildrenCount < INLINE_CHILDREN_SIZE) {
+    storeShared(&parent->inlineChildren[parent->inlineChildrenCount], child);
+    storeShared(&parent->inlineChildrenCount,
+                parent->inlineChildrenCount + 1);
+    return 0;
+  }
 
-    free(line);
+  // Keep the load factor under 1/2, removed children included
+  if (index == NULL || (index->used + 1) * 2 > index->size) {
+    rebuildChildrenIndex(parent);
   }
 
-  addReadPermissionToUserFiles();
+  insertChildIndexSlot(parent->childrenIndex, child);
 
   return 0;
 }
 
 /**
- * Gets the permissions from the ACL entry and makes them into
- * text
+ * Removes a file from the children list of its parent. It stays in
+ * the lookup of the parent until it is reclaimed
  */
-void getPermissionsAsText(struct acl_entry *aclEntry, char permissions[3]) {
-  if (aclEntry->readPermission && aclEntry->writePermission) {
-    permissions[0] = 'r';
-    permissions[1] = 'w';
-    permissions[2] = '\0';
-  } else if (aclEntry->readPermission) {
-    permissions[0] = 'r';
-    permissions[1] = '\0';
-  } else if (aclEntry->writePermission) {
-    permissions[0] = 'w';
-    permissions[1] = '\0';
+void removeChildFile(struct file_struct *parent, struct file_struct *child) {
+  if (child->prev != NULL) {
+    child->prev->next = child->next;
   } else {
-    permissions[0] = '-';
-    permissions[1] = '\0';
+    parent->children = child->next;
+  }
+
+  if (child->next != NULL) {
+    child->next->prev = child->prev;
   }
 }
 
 /**
- * Prints the whole ACL for a file. It is especially
- * useful for debugging purposes
+ * Creates a file and appends it to the children of the parent.
+ * The caller is responsible for making sure that the file doesn't
+ * exist
  */
-void printAclForFile(struct file_struct *file) {
-  printf("ACL for file %s\n", file->cmpName);
-  struct acl_entry *aclEntry;
-
-  for (aclEntry = file->aclHead; aclEntry != NULL; aclEntry = aclEntry->next) {
-    struct user_struct *user = aclEntry->user;
-    struct group_struct *group = aclEntry->group;
-    char permissions[3];
+struct file_struct *createFile(struct component_key *key,
+                               struct file_struct *parent) {
+  struct file_struct *file = poolAlloc(&filePool);
 
-    char *username;
-    char *groupname;
+  file->parent = parent;
+  file->next = NULL;
+  file->prev = NULL;
+  file->children = NULL;
+  file->acl = createAclList();
+  file->compiledAcl = createCompiledAcl(NULL);
+  file->inlineChildrenCount = 0;
+  file->childrenIndex = NULL;
+  file->createdVersion = treeVersion + 1;
+  file->deletedVersion = VERSION_NEVER;
+  file->summary = NULL;
 
-    if (user != NULL) {
-      username = user->username;
-    } else {
-      username = "*";
-    }
+  file->key = *key;
 
-    if (group != NULL) {
-      groupname = group->groupname;
-    } else {
-      groupname = "*";
-    }
+  if (parent) {
+    addChildFile(parent, file);
+  }
 
-    getPermissionsAsText(aclEntry, permissions);
+  pathCacheCreateGeneration++;
 
-    printf("\t%s.%s %s\n", username, groupname, permissions);
-  }
+  return file;
 }
 
 /**
- * Goes through the the users in the group to check if it
- * has a user.
- * Returns 1 if the user belongs to the group, 0 otherwise
+ * Validates the path and splits it into its components in a single
+ * pass, hashing them on the way. Returns E_NONE if the path is valid
+ * or the code of the first error otherwise. Components that are too
+ * long and the empty component after a / at the end still go in the
+ * file path, since CREATE makes a file out of them
  */
-int userBelongsToGroup(struct user_struct *user, struct group_struct *group) {
-  if (findGroupUser(group, user->username) == NULL) {
-    return 0;
-  }
+enum error_code splitFilePath(char *path, struct file_path *filePath) {
+  struct path_component *component;
+  enum error_code error = E_NONE;
+  char *start;
+  char *end;
+
+  filePath->count = 0;
+
+  if (!path) {
+    return E_UNDEFINED_PATH;
+  }
+
+  if (*path != '/') {
+    return E_PATH_START;
+  }
+
+  // The root
+  if (path[1] == '\0') {
+    return E_NONE;
+  }
+
+  end = path + strlen(path);
+
+  while (*path == '/') {
+    start = ++path;
+    path = characterScans.skipNameCharacters(start, end);
+
+    if (*path != '/' && *path != '\0') {
+      return error != E_NONE ? error : E_FILE_CHARACTERS;
+    }
+
+    if (path == start && *path == '/') {
+      return error != E_NONE ? error : E_DOUBLE_SLASH;
+    }
+
+    if (filePath->count == MAX_PATH_COMPONENTS) {
+      return error != E_NONE ? error : E_PATH_LENGTH;
+    }
+
+    component = &filePath->components[filePath->count++];
+    component->name = start;
+    component->length = path - start;
+    makeComponentKey(start, component->length, &component->key);
+
+    if (error == E_NONE && component->length > MAX_CMP_SIZE) {
+      error = E_COMPONENT_LENGTH;
+    }
+
+    if (error == E_NONE && component->length == 0) {
+      error = E_PATH_END;
+    }
+  }
+
+  return error;
+}
+
+/**
+ * Walks the tree as it was at the version down the first count
+ * components of the file path. Returns the file they lead to if it
+ * exists, NULL otherwise
+ */
+struct file_struct *resolveFilePath(struct file_path *filePath, int count,
+                                    unsigned long version) {
+  struct file_struct *currentFile = root;
+  int i;
+
+  for (i = 0; i < count && currentFile != NULL; i++) {
+    // No file has a name that long
+    if (filePath->components[i].length > MAX_CMP_SIZE) {
+      return NULL;
+    }
+
+    currentFile =
+        findChildByName(currentFile, &filePath->components[i].key, version);
+  }
+
+  return currentFile;
+}
+
+/**
+ * Returns the file that creating the file path would add a file to,
+ * NULL if there is none. error is what splitFilePath returned for it.
+ * Only the new file may have a name that is too long or empty, it
+ * gets what fits of it. Nothing is created in the root
+ */
+struct file_struct *findCreateParent(struct file_path *filePath,
+                                     enum error_code error) {
+  if (filePath->count < 2 ||
+      (error != E_NONE && error != E_COMPONENT_LENGTH &&
+       error != E_PATH_END)) {
+    return NULL;
+  }
+
+  return resolveFilePath(filePath, filePath->count - 1, VERSION_LATEST);
+}
+
+/**
+ * Returns the file for the path in the latest version of the tree,
+ * looking in the path cache before resolving it. Only valid paths are
+ * cached. NULL is returned if the path is invalid or if the file
+ * doesn't exist
+ */
+struct file_struct *findFileByPath(char *path) {
+  struct path_cache_entry *entry;
+  struct file_path filePath;
+  struct file_struct *file;
+  unsigned int hash;
+  unsigned int generation;
+  size_t len;
+
+  if (!path) {
+    return NULL;
+  }
+
+  len = strlen(path);
+  hash = hashName(path, len);
+  entry = &pathCache[hash & (PATH_CACHE_SIZE - 1)];
+  generation = entry->file ? pathCacheDeleteGeneration
+                           : pathCacheCreateGeneration;
+
+  if (entry->generation == generation && entry->hash == hash &&
+      strcmp(entry->path, path) == 0) {
+    pathCacheHits++;
+    return entry->file;
+  }
+
+  pathCacheMisses++;
+
+  if (splitFilePath(path, &filePath) != E_NONE) {
+    return NULL;
+  }
+
+  file = resolveFilePath(&filePath, filePath.count, VERSION_LATEST);
+
+  if (len < sizeof(entry->path)) {
+    entry->hash = hash;
+    entry->file = file;
+    entry->generation =
+        file ? pathCacheDeleteGeneration : pathCacheCreateGeneration;
+    memcpy(entry->path, path, len + 1);
+  }
+
+  return file;
+}
+
+/**
+ * Returns the file for the path as it was at the version of the tree.
+ * Used by worker threads, the path cache only holds the latest
+ * version. NULL is returned if the path is invalid or if the file
+ * didn't exist
+ */
+struct file_struct *findFileAtVersion(char *path, unsigned long version) {
+  struct file_path filePath;
+
+  if (version == VERSION_LATEST) {
+    return findFileByPath(path);
+  }
+
+  if (splitFilePath(path, &filePath) != E_NONE) {
+    return NULL;
+  }
+
+  return resolveFilePath(&filePath, filePath.count, version);
+}
+
+/**
+ * Creates the ACL entry with the specified permissions. The called is
+ * responsible for freeing the
+ * memory if needed.
+ */
+struct acl_entry *createAclEntry(char *permissions, struct user_struct *user,
+                                 struct group_struct *group) {
+  int len = strlen(permissions);
+  struct acl_entry *aclEntry = poolAlloc(&aclEntryPool);
+
+  aclEntry->next = NULL;
+  aclEntry->group = group;
+  aclEntry->user = user;
+  aclEntry->readPermission = 0;
+  aclEntry->writePermission = 0;
+
+  if (len == 1) {
+    if (*permissions == 'r') {
+      aclEntry->readPermission = 1;
+    }
+
+    if (*permissions == 'w') {
+      aclEntry->writePermission = 1;
+    }
+  }
+
+  if (len == 2) {
+    aclEntry->readPermission = 1;
+    aclEntry->writePermission = 1;
+  }
+
+  return aclEntry;
+}
+
+/**
+ * Matches an ACL entry against a user to see if it matches.
+ * Returns 1 if it is a match, 0 otherwise
+ */
+int aclUserMatch(struct acl_entry *aclEntry, struct user_struct *user) {
+  // User being NULL is the same as "*" so it matches anything
+  if (aclEntry->user == NULL || aclEntry->user == user) {
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Matches an ACL entry against a group to see if it matches.
+ * Returns 1 if it is a match, 0 otherwise
+ */
+int aclGroupMatch(struct acl_entry *aclEntry, struct group_struct *group) {
+  // Group being NULL is the same as "*" so it matches anything
+  if (aclEntry->group == NULL || aclEntry->group == group) {
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Finds the ACL entry for a file that matches both the user and the group.
+ * The ACL entry is returned if found, NULL is returned otherwise
+ */
+struct acl_entry *findAclByFileUserAndGroup(struct file_struct *file,
+                                            struct user_struct *user,
+                                            struct group_struct *group) {
+  struct acl_entry *aclEntry;
+
+  for (aclEntry = file->acl->head; aclEntry != NULL;
+       aclEntry = aclEntry->next) {
+    if (aclUserMatch(aclEntry, user) && aclGroupMatch(aclEntry, group)) {
+      return aclEntry;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Appends an ACL entry to a compiled ACL that no worker can be reading
+ */
+void appendAclRule(struct compiled_acl *compiledAcl,
+                   struct acl_entry *aclEntry) {
+  struct acl_rule *rule;
+  int permissions = 0;
+
+  if (aclEntry->readPermission) {
+    permissions |= ACL_READ;
+  }
+
+  if (aclEntry->writePermission) {
+    permissions |= ACL_WRITE;
+  }
+
+  // Nothing after a "*.*" entry is ever reached
+  if (compiledAcl->hasFallback) {
+    return;
+  }
+
+  if (aclEntry->user == NULL && aclEntry->group == NULL) {
+    compiledAcl->hasFallback = 1;
+    compiledAcl->fallback = permissions;
+    return;
+  }
+
+  if (compiledAcl->count == compiledAcl->size) {
+    compiledAcl->size =
+        compiledAcl->size ? compiledAcl->size * 2 : INITIAL_ACL_RULES_SIZE;
+    compiledAcl->rules = realloc(compiledAcl->rules,
+                                 compiledAcl->size * sizeof(struct acl_rule));
+
+    if (compiledAcl->rules == NULL) {
+      printAndExit(NULL);
+    }
+  }
+
+  rule = &compiledAcl->rules[compiledAcl->count];
+  rule->userId = aclEntry->user ? aclEntry->user->id : ACL_ANY;
+  rule->groupId = aclEntry->group ? aclEntry->group->id : ACL_ANY;
+  rule->permissions = permissions;
+
+  compiledAcl->count++;
+}
+
+/**
+ * Rebuilds the compiled ACL of the file from its ACL list. Has to be
+ * called every time the ACL list of the file is replaced. While
+ * workers may read the old one, or other files share it, a new one is
+ * built and published
+ */
+void compileAcl(struct file_struct *file) {
+  struct compiled_acl *compiledAcl = file->compiledAcl;
+  struct acl_entry *aclEntry;
+
+  if (snapshotsInUse) {
+    compiledAcl = createCompiledAcl(compiledAcl);
+  } else if (compiledAcl->references > 1) {
+    compiledAcl = createCompiledAcl(NULL);
+  } else {
+    compiledAcl->count = 0;
+    compiledAcl->hasFallback = 0;
+    compiledAcl->fallback = 0;
+    compiledAcl->version = treeVersion + 1;
+  }
+
+  for (aclEntry = file->acl->head; aclEntry != NULL;
+       aclEntry = aclEntry->next) {
+    appendAclRule(compiledAcl, aclEntry);
+  }
+
+  aclGeneration++;
+
+  if (compiledAcl == file->compiledAcl) {
+    return;
+  }
+
+  // Without workers nothing reads the old one anymore
+  if (compiledAcl->older == NULL) {
+    releaseCompiledAcl(file->compiledAcl);
+  }
+
+  storeShared(&file->compiledAcl, compiledAcl);
+
+  if (compiledAcl->older != NULL) {
+    retireObject(compiledAcl->older, RETIRED_ACL, compiledAcl->version,
+                 (void **)&compiledAcl->older);
+  }
+}
+
+/**
+ * Evaluates the compiled ACL that the file had at the version for the
+ * user and group. The first matching rule wins, if no rule matches
+ * the fallback is used.
+ * Returns the ACL_READ and ACL_WRITE bits that apply
+ */
+int getAclPermissions(struct file_struct *file, struct user_struct *user,
+                      struct group_struct *group, unsigned long version) {
+  struct compiled_acl *compiledAcl = loadShared(&file->compiledAcl);
+  struct acl_rule *rule;
+  struct acl_rule *end;
+  int userId = user->id;
+  int groupId = group->id;
+
+  while (compiledAcl->version > version) {
+    compiledAcl = loadShared(&compiledAcl->older);
+  }
+
+  rule = compiledAcl->rules;
+  end = rule + compiledAcl->count;
+
+  for (; rule < end; rule++) {
+    int userMatch = (rule->userId == userId) | (rule->userId == ACL_ANY);
+    int groupMatch = (rule->groupId == groupId) | (rule->groupId == ACL_ANY);
+
+    if (userMatch & groupMatch) {
+      countWork(aclEntriesScanned, rule - compiledAcl->rules + 1);
+      return rule->permissions;
+    }
+  }
+
+  countWork(aclEntriesScanned, compiledAcl->count);
+
+  return compiledAcl->fallback;
+}
+
+/**
+ * Adds ACL to the acl list of a file
+ */
+void addAclToFile(struct file_struct *file, char *permissions,
+                  struct user_struct *user, struct group_struct *group) {
+  if (DEBUGGING && findAclByFileUserAndGroup(file, user, group)) {
+    dbg("File already had ACL for that group and user\n");
+  }
+
+  if (DEBUGGING && file->acl->references > 1) {
+    dbg("Adding to a shared ACL\n");
+  }
+
+  struct acl_entry *aclEntry = createAclEntry(permissions, user, group);
+
+  // Only done before the workers start reading and before any file
+  // shares its ACL
+  appendAclRule(file->compiledAcl, aclEntry);
+  aclGeneration++;
+
+  if (file->acl->tail == NULL) {
+    file->acl->tail = file->acl->head = aclEntry;
+    return;
+  }
+
+  file->acl->tail->next = aclEntry;
+  file->acl->tail = aclEntry;
+}
+
+/**
+ * Validates the file path. Then starts going component by
+ * component verifying if it exists and if it doesn't, it creates
+ * it. Returns the last created file if there was no error. NULL
+ * is returned otherwise and *error is set
+ */
+struct file_struct *addFileByPath(char *pathStart, enum error_code *error) {
+  struct file_path filePath;
+  struct file_struct *currentFile = root;
+  struct file_struct *child;
+  int last;
+  int i;
+
+  *error = splitFilePath(pathStart, &filePath);
+
+  if (*error != E_NONE) {
+    return NULL;
+  }
+
+  for (i = 0; i < filePath.count; i++) {
+    last = i == filePath.count - 1;
+    child = findChildByName(currentFile, &filePath.components[i].key,
+                            VERSION_LATEST);
+
+    if (last && child) {
+      *error = E_FILE_EXISTED;
+      return NULL;
+    }
+
+    if (child) {
+      currentFile = child;
+    } else {
+      currentFile = createFile(&filePath.components[i].key, currentFile);
+
+      // Add *.* r ACL to files along the path
+      if (!last) {
+        addAclToFile(currentFile, "r", NULL, NULL);
+      }
+    }
+  }
+
+  return currentFile;
+}
+
+/**
+ * Finds the slot where the name is stored in the table or, if it
+ * isn't there, the empty slot where it should be inserted. Uses
+ * linear probing so the slots for a name are next to each other.
+ */
+struct name_slot *findNameSlot(struct name_table *table, struct span name,
+                               unsigned int hash) {
+  unsigned int mask = table->size - 1;
+  unsigned int position = hash & mask;
+
+  while (1) {
+    struct name_slot *slot = &table->slots[position];
+
+    // The hash and name are set before the entry is published
+    if (loadShared(&slot->entry) == NULL) {
+      return slot;
+    }
+
+    if (slot->hash == hash &&
+        strncmp(slot->name, name.start, name.length) == 0 &&
+        slot->name[name.length] == '\0') {
+      return slot;
+    }
+
+    position = (position + 1) & mask;
+  }
+}
+
+/**
+ * Replaces the table of the index with one twice the size. The old
+ * one is freed once no worker can be reading it
+ */
+void growNameIndex(struct name_index *index) {
+  struct name_table *oldTable = index->table;
+  struct name_table *table;
+  unsigned int oldSize = oldTable ? oldTable->size : 0;
+  unsigned int size = oldSize ? oldSize * 2 : INITIAL_INDEX_SIZE;
+  unsigned int mask = size - 1;
+  unsigned int i;
+
+  table = calloc(1, sizeof(struct name_table) +
+                        size * sizeof(struct name_slot));
+
+  if (table == NULL) {
+    printAndExit(NULL);
+  }
+
+  table->size = size;
+
+  for (i = 0; i < oldSize; i++) {
+    struct name_slot *slot = &oldTable->slots[i];
+    unsigned int position = slot->hash & mask;
+
+    if (slot->entry == NULL) {
+      continue;
+    }
+
+    // Names are unique so any empty slot in the sequence will do
+    while (table->slots[position].entry != NULL) {
+      position = (position + 1) & mask;
+    }
+
+    table->slots[position] = *slot;
+  }
+
+  storeShared(&index->table, table);
+
+  if (oldTable != NULL) {
+    retireObject(oldTable, RETIRED_MEMORY, 0, NULL);
+  }
+}
+
+/**
+ * Returns the entry stored in the index under the name, NULL is
+ * returned if there is none.
+ */
+void *findInNameIndex(struct name_index *index, struct span name) {
+  struct name_table *table = loadShared(&index->table);
+
+  if (table == NULL) {
+    return NULL;
+  }
+
+  return loadShared(
+      &findNameSlot(table, name, hashName(name.start, name.length))->entry);
+}
+
+/**
+ * Adds an entry to the index. The name must not be in the index
+ * already and must live as long as the entry does.
+ */
+void addToNameIndex(struct name_index *index, char *name, void *entry) {
+  struct name_slot *slot;
+  struct span nameSpan = {name, strlen(name)};
+  unsigned int hash = hashName(name, nameSpan.length);
+
+  // Keep the load factor under 1/2 so probe sequences stay short
+  if (index->table == NULL || (index->count + 1) * 2 > index->table->size) {
+    growNameIndex(index);
+  }
+
+  slot = findNameSlot(index->table, nameSpan, hash);
+  slot->hash = hash;
+  slot->name = name;
+  storeShared(&slot->entry, entry);
+
+  index->count++;
+}
+
+/**
+ * Grows the index until count more entries fit without growing it
+ */
+void reserveNameIndex(struct name_index *index, unsigned int count) {
+  while (index->table == NULL ||
+         (index->count + count) * 2 > index->table->size) {
+    growNameIndex(index);
+  }
+}
+
+/**
+ * Searches the user index for a user matching the username. The
+ * user is returned if found, NULL is returned otherwise.
+ */
+struct user_struct *findUserByUsername(struct span username) {
+  return findInNameIndex(&usersIndex, username);
+}
+
+/**
+ * Searches the group index for a group matching the groupname. The
+ * group is returned if found, NULL is returned otherwise.
+ */
+struct group_struct *findGroupByGroupname(struct span groupname) {
+  return findInNameIndex(&groupsIndex, groupname);
+}
+
+/**
+ * Adds a user with the username, which must live as long as the user
+ * does. The caller should make sure the user doesn't exist
+ */
+struct user_struct *addUser(char *username) {
+  struct user_struct *user = malloc(sizeof(struct user_struct));
+
+  if (user == NULL) {
+    printAndExit(NULL);
+  }
+
+  user->username = username;
+  user->id = usersCount++;
+  user->next = usersHead;
+  user->groups = NULL;
+  user->file = NULL;
+  user->membership = NULL;
+  user->createdVersion = treeVersion + 1;
+
+  usersHead = user;
+
+  addToNameIndex(&usersIndex, user->username, user);
+
+  return user;
+}
+
+/**
+ * Creates a user if it doesn't exist. The called should make
+ * sure the user doesn't exist before calling this function
+ */
+struct user_struct *createUser(struct span username) {
+  char *name;
+
+  if (findUserByUsername(username) != NULL) {
+    // Should never happen
+    printAndExit("User already exists.");
+  }
+
+  name = strndup(username.start, username.length);
+
+  if (name == NULL) {
+    printAndExit(NULL);
+  }
+
+  if (journal.recording) {
+    journalNames(J_USER, name, NULL);
+  }
+
+  return addUser(name);
+}
+
+/**
+ * Adds a group with the groupname, which must live as long as the
+ * group does. The caller should make sure the group doesn't exist
+ */
+struct group_struct *addGroup(char *groupname) {
+  struct group_struct *group = malloc(sizeof(struct group_struct));
+
+  if (group == NULL) {
+    printAndExit(NULL);
+  }
+
+  group->groupname = groupname;
+  group->id = groupsCount++;
+  group->next = groupsHead;
+  group->users = NULL;
+  group->createdVersion = treeVersion + 1;
+
+  groupsHead = group;
+
+  addToNameIndex(&groupsIndex, group->groupname, group);
+
+  return group;
+}
+
+/**
+ * Creats a group if it doesn't exist. The caller should
+ * make sure the group doesn't exist before calling this
+ * function
+ */
+struct group_struct *createGroup(struct span groupname) {
+  char *name;
+
+  if (findGroupByGroupname(groupname) != NULL) {
+    printAndExit("Group already exists");
+  }
+
+  name = strndup(groupname.start, groupname.length);
+
+  if (name == NULL) {
+    printAndExit(NULL);
+  }
+
+  if (journal.recording) {
+    journalNames(J_GROUP, name, NULL);
+  }
+
+  return addGroup(name);
+}
+
+/**
+ * Binary searches the sorted group ids of the membership. Returns the
+ * position of the group id if it is there, or the position where it
+ * should be inserted otherwise
+ */
+int findGroupIdPosition(struct membership *membership, int groupId) {
+  int low = 0;
+  int high = membership->count;
+
+  while (low < high) {
+    int middle = low + (high - low) / 2;
+
+    if (membership->groupIds[middle] < groupId) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  return low;
+}
+
+/**
+ * Checks the group ids that the user had at the version for the
+ * group. Returns 1 if the user belonged to the group, 0 otherwise
+ */
+int userBelongsToGroup(struct user_struct *user, struct group_struct *group,
+                       unsigned long version) {
+  struct membership *membership = loadShared(&user->membership);
+  int position;
+
+  while (membership != NULL && membership->version > version) {
+    membership = loadShared(&membership->older);
+  }
+
+  if (membership == NULL) {
+    return 0;
+  }
+
+  position = findGroupIdPosition(membership, group->id);
+
+  if (position < membership->count &&
+      membership->groupIds[position] == group->id) {
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Inserts the group id in the sorted group ids of the user. The
+ * caller must make sure the user doesn't belong to the group yet.
+ * While workers may read the group ids they are copied instead
+ */
+void addUserGroupId(struct user_struct *user, int groupId) {
+  struct membership *oldMembership = user->membership;
+  struct membership *membership = oldMembership;
+  int position = 0;
+  int size;
+
+  if (oldMembership != NULL) {
+    position = findGroupIdPosition(oldMembership, groupId);
+  }
+
+  if (snapshotsInUse || membership == NULL ||
+      membership->count == membership->size) {
+    size = oldMembership ? oldMembership->size : INITIAL_MEMBERSHIP_SIZE;
+
+    if (oldMembership != NULL && oldMembership->count == size) {
+      size *= 2;
+    }
+
+    membership = malloc(sizeof(struct membership) + size * sizeof(int));
+
+    if (membership == NULL) {
+      printAndExit(NULL);
+    }
+
+    membership->older = oldMembership;
+    membership->count = 0;
+    membership->size = size;
+
+    if (oldMembership != NULL) {
+      membership->count = oldMembership->count;
+      memcpy(membership->groupIds, oldMembership->groupIds,
+             oldMembership->count * sizeof(int));
+    }
+  }
+
+  memmove(&membership->groupIds[position + 1],
+          &membership->groupIds[position],
+          (membership->count - position) * sizeof(int));
+  membership->groupIds[position] = groupId;
+  membership->count++;
+  membership->version = treeVersion + 1;
+
+  if (membership != oldMembership) {
+    storeShared(&user->membership, membership);
+
+    if (oldMembership != NULL) {
+      retireObject(oldMembership, RETIRED_MEMBERSHIP, membership->version,
+                   (void **)&membership->older);
+    }
+  }
+}
+
+/**
+ * Adds the group to the list of groups of the user and the user to
+ * the list of users of the group
+ */
+void linkUserAndGroup(struct user_struct *user, struct group_struct *group) {
+  struct user_group_list *userGroupContainer;
+  struct group_user_list *groupUserContainer;
+
+  userGroupContainer = poolAlloc(&userGroupPool);
+
+  userGroupContainer->group = group;
+  userGroupContainer->next = user->groups;
+  user->groups = userGroupContainer;
+
+  groupUserContainer = poolAlloc(&groupUserPool);
+
+  groupUserContainer->user = user;
+  groupUserContainer->next = group->users;
+  group->users = groupUserContainer;
+}
+
+/**
+ * Adds the user to the list in the group and adds the
+ * group to the list of groups for the user (if necessary).
+ */
+void addUserToGroup(struct user_struct *user, struct group_struct *group) {
+  // Both lists are always updated together so the ids tell for both
+  if (userBelongsToGroup(user, group, VERSION_LATEST)) {
+    return;
+  }
+
+  addUserGroupId(user, group->id);
+  linkUserAndGroup(user, group);
+
+  if (journal.recording) {
+    journalNames(J_MEMBERSHIP, user->username, group->groupname);
+  }
+}
+
+/**
+ * Creates the user and group if they don't exist. Then adds
+ * the user to the group.
+ */
+int addUserAndGroup(struct span username, struct span groupname) {
+  struct user_struct *user = findUserByUsername(username);
+  struct group_struct *group = findGroupByGroupname(groupname);
+
+  if (user == NULL) {
+    user = createUser(username);
+  }
+
+  if (group == NULL) {
+    group = createGroup(groupname);
+  }
+
+  addUserToGroup(user, group);
+
+  return 0;
+}
+
+/**
+ * Gets the username from the line, end is where the line ends.
+ * *username points into the line.
+ * Returns the position after the username ends (should be ""*)
+ * or NULL with *error set if the username is invalid.
+ */
+char *getUsername(char *userStart, char *end, struct span *username,
+                  enum error_code *error) {
+  // Get user name
+  char *line = characterScans.skipLetters(userStart, end);
+
+  if (line == end || *line != '.') {
+    *error = E_USER_CHARACTERS;
+    return NULL;
+  }
+
+  if (line == userStart) {
+    *error = E_EMPTY_USER;
+    return NULL;
+  }
+
+  username->start = userStart;
+  username->length = line - userStart;
+
+  return line;
+}
+
+/**
+ * Gets the groupname from the line, end is where the line ends.
+ * *groupname points into the line.
+ * Returns the position after the groupname ends or NULL with
+ * *error set if the groupname is invalid.
+ */
+char *getGroupname(char *groupStart, char *end, struct span *groupname,
+                   enum error_code *error) {
+  // Get group name
+  char *line = characterScans.skipLetters(groupStart, end);
+
+  if (line != end && *line != ' ') {
+    *error = E_GROUP_CHARACTERS;
+    return NULL;
+  }
+
+  if (line == groupStart) {
+    *error = E_EMPTY_GROUP;
+    return NULL;
+  }
+
+  groupname->start = groupStart;
+  groupname->length = line - groupStart;
+
+  return line;
+}
+
+/**
+ * Gets username and groupname from the line. Both of them
+ * point into the line.
+ * Returns the position of the line after the groupname ends
+ */
+char *getUsernameAndGroupname(char *userStart, char *end,
+                              struct span *username, struct span *groupname,
+                              enum error_code *error) {
+  char *line = userStart;
+
+  line = getUsername(line, end, username, error);
+
+  if (line == NULL) {
+    return NULL;
+  }
+
+  line++;
+
+  return getGroupname(line, end, groupname, error);
+}
+
+/**
+ * Returns 1 if the name is "*", 0 otherwise
+ */
+int isWildcard(struct span name) {
+  return name.length == 1 && *name.start == '*';
+}
+
+/**
+ * Gets the username and groupname. It is different from
+ * getUsernameAndGroupname that it allows username and
+ * groupname to be "*"
+ */
+char *getUsernameAndGroupnameForAcl(char *userStart, char *end,
+                                    struct span *username,
+                                    struct span *groupname,
+                                    enum error_code *error) {
+  char *line = userStart;
+
+  if (line != end && *line == '*') {
+    username->start = line;
+    username->length = 1;
+    line++;
+  } else {
+    line = getUsername(line, end, username, error);
+
+    if (line == NULL) {
+      return NULL;
+    }
+  }
+
+  if (line == end || *line != '.') {
+    *error = E_MISSING_DOT;
+    return NULL;
+  }
+
+  line++;
+
+  if (line != end && *line == '*') {
+    groupname->start = line;
+    groupname->length = 1;
+    line++;
+  } else {
+    line = getGroupname(line, end, groupname, error);
+
+    if (line == NULL) {
+      return NULL;
+    }
+  }
+
+  return line;
+}
+
+/**
+ * Extracts the file path from the line, end is where the line
+ * ends. *filePath points into the line.
+ * Returns the position where the filePath ends or
+ * NULL if there was an error, which is stored in *error.
+ */
+char *getFilepath(char *line, char *end, struct span *filePath,
+                  enum error_code *error) {
+  char *filePathStart = line;
+
+  if (line == end || *filePathStart != '/') {
+    *error = E_PATH_START;
+    return NULL;
+  }
+
+  // Get file
+  line = characterScans.skipPathCharacters(filePathStart, end);
+
+  if (line != end) {
+    *error = *line == '/' ? E_DOUBLE_SLASH : E_FILE_CHARACTERS;
+    return NULL;
+  }
+
+  if (line - filePathStart > MAX_FILE_NAME_SIZE) {
+    *error = E_PATH_LENGTH;
+    return NULL;
+  }
+
+  filePath->start = filePathStart;
+  filePath->length = line - filePathStart;
+
+  return line;
+}
+
+/**
+ * Copies the path to the buffer and NUL terminates it. The path must
+ * already be checked not to exceed MAX_FILE_NAME_SIZE.
+ */
+char *copyFilepath(struct span filePath, char buffer[MAX_FILE_NAME_SIZE + 1]) {
+  memcpy(buffer, filePath.start, filePath.length);
+  buffer[filePath.length] = '\0';
+
+  return buffer;
+}
+
+/**
+ * Gets user, group and file from the line, validates
+ * them and creates them, if necessary.
+ * Returns E_NONE if the line is valid or the code of the
+ * error that was found otherwise
+ */
+enum error_code parseUserDefinitionLine(char *line, char *end) {
+  char fileName[MAX_FILE_NAME_SIZE + 1];
+  struct span filePath;
+  struct user_struct *user;
+  struct group_struct *group;
+  struct user_struct *possibleUser;
+  struct file_struct *file;
+  struct span username;
+  struct span groupname;
+  enum error_code error = E_NONE;
+
+  line = getUsernameAndGroupname(line, end, &username, &groupname, &error);
+
+  // An error ocurred
+  if (line == NULL) {
+    return error;
+  }
+
+  possibleUser = findUserByUsername(username);
+
+  // Means no file specified and first time we see the user
+  if ((line == end || *line != ' ') && possibleUser == NULL) {
+    return E_MISSING_FIRST_FILE;
+  }
+
+  // Means no file specified but it is ot the first time we see the user
+  if (line == end || *line != ' ') {
+    addUserAndGroup(username, groupname);
+    user = findUserByUsername(username);
+    group = findGroupByGroupname(groupname);
+
+    addAclToFile(user->file, "rw", user, group);
+
+    return E_NONE;
+  }
+
+  // Skip ' '
+  line++;
+  line = getFilepath(line, end, &filePath, &error);
+
+  // Error with the file. The error is already set
+  if (line == NULL) {
+    return error;
+  }
+
+  // Means file specified but it is not the first time we see the user
+  if (filePath.length && possibleUser != NULL) {
+    return E_NOT_FIRST_FILE;
+  }
+
+  // Means no file specified but it is the first time we see the user
+  if (!filePath.length && possibleUser == NULL) {
+    return E_MISSING_FIRST_FILE;
+  }
+
+  file = addFileByPath(copyFilepath(filePath, fileName), &error);
+
+  // Error creating the file. The error is already set
+  if (file == NULL) {
+    return error;
+  }
+
+  addUserAndGroup(username, groupname);
+  user = findUserByUsername(username);
+  group = findGroupByGroupname(groupname);
+
+  user->file = file;
+
+  addAclToFile(user->file, "rw", user, group);
+
+  return E_NONE;
+}
+
+/**
+ * Creates the root folder along with /tmp and /home and
+ * gives them the ACL
+ */
+int initFs() {
+  struct component_key key;
+
+  makeComponentKey("/", 1, &key);
+  root = createFile(&key, NULL);
+
+  makeComponentKey("tmp", 3, &key);
+  struct file_struct *tmp = createFile(&key, root);
+  makeComponentKey("home", 4, &key);
+  struct file_struct *home = createFile(&key, root);
+
+  addAclToFile(root, "r", NULL, NULL);
+  addAclToFile(tmp, "rw", NULL, NULL);
+  addAclToFile(home, "r", NULL, NULL);
+
+  return 0;
+}
+
+/**
+ * Moves the bytes not handed out yet to the start of the buffer and
+ * reads more input after them, growing the buffer if it is full.
+ * Sets the eof flag of the reader when there is no more input
+ */
+void fillReader(struct line_reader *reader) {
+  ssize_t bytesRead;
+
+  if (reader->start > 0) {
+    memmove(reader->buffer, reader->buffer + reader->start,
+            reader->end - reader->start);
+    reader->end -= reader->start;
+    reader->start = 0;
+  }
+
+  // Always leave room to terminate the last line
+  if (reader->end + 1 >= reader->size) {
+    reader->size = reader->size ? reader->size * 2 : READ_BUFFER_SIZE;
+    reader->buffer = realloc(reader->buffer, reader->size);
+
+    if (reader->buffer == NULL) {
+      printAndExit(NULL);
+    }
+  }
+
+  do {
+    bytesRead = read(reader->fd, reader->buffer + reader->end,
+                     reader->size - reader->end - 1);
+  } while (bytesRead < 0 && errno == EINTR);
+
+  if (bytesRead < 0) {
+    printAndExit(NULL);
+  }
+
+  if (bytesRead == 0) {
+    reader->eof = 1;
+  }
+
+  reader->end += bytesRead;
+}
+
+/**
+ * Gets a line from the input. The line points into the input buffer
+ * and is not NUL terminated, *lineEnd is set to where it ends. It is
+ * only valid until the next call, see keepLine. If it reaches the end
+ * of input, the endOfInput global variable is set
+ */
+char *getLine(char **lineEnd) {
+  struct line_reader *reader = &input;
+  char *line;
+  char *newline;
+  size_t scanned = 0;
+
+  while (1) {
+    line = reader->buffer + reader->start;
+    newline = NULL;
+
+    if (reader->end - reader->start > scanned) {
+      newline = memchr(line + scanned, '\n',
+                       reader->end - reader->start - scanned);
+    }
+
+    if (newline != NULL || reader->eof) {
+      break;
+    }
+
+    // Don't scan the same bytes again after filling
+    scanned = reader->end - reader->start;
+    fillReader(reader);
+  }
+
+  if (newline == NULL) {
+    endOfInput = 1;
+    newline = reader->buffer + reader->end;
+    reader->start = reader->end;
+  } else {
+    reader->start = newline - reader->buffer + 1;
+  }
+
+  *lineEnd = newline;
+
+  return line;
+}
+
+/**
+ * Makes sure the line stays valid after getLine is called again.
+ * Mapped input never moves so the line is returned as it is,
+ * otherwise it is copied to a buffer where only the last kept
+ * line is valid
+ */
+char *keepLine(char *line, char **lineEnd) {
+  size_t len = *lineEnd - line;
+
+  if (input.mapped) {
+    return line;
+  }
+
+  if (len + 1 > keptLineSize) {
+    keptLineSize = len + 1 > INITIAL_LINE_SIZE ? len + 1 : INITIAL_LINE_SIZE;
+    free(keptLine);
+    keptLine = malloc(keptLineSize);
+
+    if (keptLine == NULL) {
+      printAndExit(NULL);
+    }
+  }
+
+  memcpy(keptLine, line, len);
+  keptLine[len] = '\0';
+  *lineEnd = keptLine + len;
+
+  return keptLine;
+}
+
+/**
+ * Reads the input from the file instead of STDIN. Regular files
+ * are mapped into memory and parsed in place, anything else is
+ * read in blocks like STDIN
+ */
+void openInputFile(char *path) {
+  struct stat fileStat;
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0 || fstat(fd, &fileStat) < 0) {
+    printAndExit(NULL);
+  }
+
+  input.fd = fd;
+
+  if (!S_ISREG(fileStat.st_mode) || fileStat.st_size == 0) {
+    return;
+  }
+
+  input.buffer =
+      mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  if (input.buffer == MAP_FAILED) {
+    printAndExit(NULL);
+  }
+
+  // The input is parsed front to back exactly once
+  madvise(input.buffer, fileStat.st_size, MADV_SEQUENTIAL);
+
+  input.size = fileStat.st_size;
+  input.end = fileStat.st_size;
+  input.eof = 1;
+  input.mapped = 1;
+}
+
+/**
+ * Returns 1 if the line is a single "." (the end of a section or
+ * of an ACL), 0 otherwise
+ */
+int isEndOfList(char *line, char *end) {
+  return end - line == 1 && *line == '.';
+}
+
+/**
+ * Goes through all the files belonging to users adding
+ * read permissions for everybody at the end of the ACL.
+ * This is done to allow another user to own a file inside
+ * another user's file
+ */
+void addReadPermissionToUserFiles() {
+  struct user_struct *window = usersHead;
+
+  while (window != NULL) {
+    struct file_struct *file = window->file;
+
+    if (file != NULL) {
+      addAclToFile(file, "r", NULL, NULL);
+    }
+
+    window = window->next;
+  }
+}
+
+/**
+ * Parses the user definition section line by line and
+ * initializes the users, groups and files. This
+ * function runs until a single line with a "." is found
+ * denoting the end of the user definition section
+ */
+int parseUserDefinitionSection() {
+  char *line;
+  char *end;
+  int num = 1;
+  enum error_code result;
+
+  while (1) {
+    line = getLine(&end);
+
+    if (endOfInput) {
+      break;
+    }
+
+    if (isEndOfList(line, end)) {
+      break;
+    }
+
+    result = parseUserDefinitionLine(line, end);
+
+    if (result == E_NONE) {
+      printResult(num, "Y", NULL, 0, NULL);
+    } else {
+      printResult(num, "X", NULL, 0, errors[result].message);
+    }
+
+    num++;
+  }
+
+  addReadPermissionToUserFiles();
+
+  return 0;
+}
+
+/**
+ * Writes all of the data to the file, exits if it can't
+ */
+void writeFileData(int fd, void *data, size_t length) {
+  char *position = data;
+
+  while (length > 0) {
+    ssize_t result = write(fd, position, length);
+
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (result < 0) {
+      printAndExit(NULL);
+    }
+
+    position += result;
+    length -= result;
+  }
+}
+
+/**
+ * Compares two file numbers by the address of their files
+ */
+int compareFileNumbers(const void *a, const void *b) {
+  struct file_struct *fileA = ((const struct file_number *)a)->file;
+  struct file_struct *fileB = ((const struct file_number *)b)->file;
+
+  return (fileA > fileB) - (fileA < fileB);
+}
+
+/**
+ * Returns the index that the file has in the snapshot, -1 for NULL.
+ * numbers must be sorted by the address of the files
+ */
+int32_t getFileNumber(struct file_number *numbers, size_t count,
+                      struct file_struct *file) {
+  struct file_number key = {file, 0};
+  struct file_number *number;
+
+  if (file == NULL) {
+    return -1;
+  }
+
+  number = bsearch(&key, numbers, count, sizeof(struct file_number),
+                   compareFileNumbers);
+
+  return number->index;
+}
+
+/**
+ * Returns 1 if the file inherited the ACL of its parent and still
+ * shares it, 0 otherwise
+ */
+int sharesParentAcl(struct file_struct *file) {
+  return file->parent != NULL && file->acl == file->parent->acl;
+}
+
+/**
+ * Returns every file of the tree in an order where parents come
+ * before their children, *count is set to the number of files
+ */
+struct file_struct **listFiles(size_t *count) {
+  size_t size = INITIAL_INDEX_SIZE;
+  struct file_struct **files = malloc(size * sizeof(struct file_struct *));
+  struct file_struct *child;
+  size_t i;
+
+  if (files == NULL) {
+    printAndExit(NULL);
+  }
+
+  files[0] = root;
+  *count = 1;
+
+  // The list is also the queue of files whose children are missing
+  for (i = 0; i < *count; i++) {
+    for (child = files[i]->children; child != NULL; child = child->next) {
+      if (*count == size) {
+        size *= 2;
+        files = realloc(files, size * sizeof(struct file_struct *));
+
+        if (files == NULL) {
+          printAndExit(NULL);
+        }
+      }
+
+      files[(*count)++] = child;
+    }
+  }
+
+  return files;
+}
+
+/**
+ * Allocates an array for a section of a snapshot, exits if it can't
+ */
+void *allocateSection(size_t count, size_t size) {
+  // malloc(0) may return NULL
+  void *section = malloc(count ? count * size : 1);
+
+  if (section == NULL) {
+    printAndExit(NULL);
+  }
+
+  return section;
+}
+
+/**
+ * Saves the users, groups, memberships, files and ACLs to the path in
+ * the snapshot format. The snapshot is written next to it first and
+ * then renamed, so the path always has a whole snapshot
+ */
+void saveSnapshot(char *path) {
+  struct snapshot_header header;
+  struct user_struct **users = allocateSection(usersCount, sizeof(void *));
+  struct group_struct **groups =
+      allocateSection(groupsCount, sizeof(void *));
+  struct snapshot_user *snapshotUsers;
+  struct snapshot_group *snapshotGroups;
+  struct snapshot_file *snapshotFiles;
+  struct snapshot_acl_entry *snapshotAcl;
+  struct file_number *numbers;
+  struct file_struct **files;
+  struct user_struct *user;
+  struct group_struct *group;
+  struct acl_entry *aclEntry;
+  int32_t *memberships;
+  char *strings;
+  char *temporaryPath;
+  size_t filesCount;
+  size_t membershipsCount = 0;
+  size_t aclEntriesCount = 0;
+  size_t stringsSize = 0;
+  size_t i;
+  int fd;
+
+  for (user = usersHead; user != NULL; user = user->next) {
+    users[user->id] = user;
+    stringsSize += strlen(user->username) + 1;
+
+    if (user->membership != NULL) {
+      membershipsCount += user->membership->count;
+    }
+  }
+
+  for (group = groupsHead; group != NULL; group = group->next) {
+    groups[group->id] = group;
+    stringsSize += strlen(group->groupname) + 1;
+  }
+
+  files = listFiles(&filesCount);
+  numbers = allocateSection(filesCount, sizeof(struct file_number));
+
+  for (i = 0; i < filesCount; i++) {
+    numbers[i].file = files[i];
+    numbers[i].index = i;
+
+    if (!sharesParentAcl(files[i])) {
+      for (aclEntry = files[i]->acl->head; aclEntry != NULL;
+           aclEntry = aclEntry->next) {
+        aclEntriesCount++;
+      }
+    }
+  }
+
+  qsort(numbers, filesCount, sizeof(struct file_number), compareFileNumbers);
+
+  snapshotUsers = allocateSection(usersCount, sizeof(struct snapshot_user));
+  snapshotGroups =
+      allocateSection(groupsCount, sizeof(struct snapshot_group));
+  memberships = allocateSection(membershipsCount, sizeof(int32_t));
+  snapshotFiles = allocateSection(filesCount, sizeof(struct snapshot_file));
+  snapshotAcl =
+      allocateSection(aclEntriesCount, sizeof(struct snapshot_acl_entry));
+  strings = allocateSection(stringsSize, 1);
+
+  stringsSize = 0;
+  membershipsCount = 0;
+
+  for (i = 0; i < (size_t)usersCount; i++) {
+    struct membership *membership = users[i]->membership;
+    int j;
+
+    snapshotUsers[i].name = stringsSize;
+    strcpy(strings + stringsSize, users[i]->username);
+    stringsSize += strlen(users[i]->username) + 1;
+    snapshotUsers[i].file = getFileNumber(numbers, filesCount, users[i]->file);
+    snapshotUsers[i].firstMembership = membershipsCount;
+    snapshotUsers[i].membershipsCount = membership ? membership->count : 0;
+
+    for (j = 0; membership != NULL && j < membership->count; j++) {
+      memberships[membershipsCount++] = membership->groupIds[j];
+    }
+  }
+
+  for (i = 0; i < (size_t)groupsCount; i++) {
+    snapshotGroups[i].name = stringsSize;
+    strcpy(strings + stringsSize, groups[i]->groupname);
+    stringsSize += strlen(groups[i]->groupname) + 1;
+  }
+
+  aclEntriesCount = 0;
+
+  for (i = 0; i < filesCount; i++) {
+    struct snapshot_file *snapshotFile = &snapshotFiles[i];
+
+    snapshotFile->parent = getFileNumber(numbers, filesCount,
+                                         files[i]->parent);
+    snapshotFile->firstAclEntry = aclEntriesCount;
+    memcpy(snapshotFile->cmpName, getComponentName(&files[i]->key),
+           MAX_CMP_SIZE);
+
+    // The entries of the parent are listed once for both
+    if (sharesParentAcl(files[i])) {
+      struct snapshot_file *parentFile = &snapshotFiles[snapshotFile->parent];
+
+      snapshotFile->firstAclEntry = parentFile->firstAclEntry;
+      snapshotFile->aclEntriesCount = parentFile->aclEntriesCount;
+      continue;
+    }
+
+    for (aclEntry = files[i]->acl->head; aclEntry != NULL;
+         aclEntry = aclEntry->next) {
+      struct snapshot_acl_entry *entry = &snapshotAcl[aclEntriesCount++];
+
+      entry->userId = aclEntry->user ? aclEntry->user->id : ACL_ANY;
+      entry->groupId = aclEntry->group ? aclEntry->group->id : ACL_ANY;
+      entry->permissions = (aclEntry->readPermission ? ACL_READ : 0) |
+                           (aclEntry->writePermission ? ACL_WRITE : 0);
+    }
+
+    snapshotFile->aclEntriesCount =
+        aclEntriesCount - snapshotFile->firstAclEntry;
+  }
+
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.usersCount = usersCount;
+  header.groupsCount = groupsCount;
+  header.membershipsCount = membershipsCount;
+  header.filesCount = filesCount;
+  header.aclEntriesCount = aclEntriesCount;
+  header.stringsSize = stringsSize;
+  header.journalSequence = journal.sequence;
+
+  temporaryPath = malloc(strlen(path) + sizeof(".tmp"));
+
+  if (temporaryPath == NULL) {
+    printAndExit(NULL);
+  }
+
+  strcpy(temporaryPath, path);
+  strcat(temporaryPath, ".tmp");
+
+  fd = open(temporaryPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+  if (fd < 0) {
+    printAndExit(NULL);
+  }
+
+  writeFileData(fd, &header, sizeof(header));
+  writeFileData(fd, snapshotUsers, usersCount * sizeof(*snapshotUsers));
+  writeFileData(fd, snapshotGroups, groupsCount * sizeof(*snapshotGroups));
+  writeFileData(fd, memberships, membershipsCount * sizeof(int32_t));
+  writeFileData(fd, snapshotFiles, filesCount * sizeof(*snapshotFiles));
+  writeFileData(fd, snapshotAcl, aclEntriesCount * sizeof(*snapshotAcl));
+  writeFileData(fd, strings, stringsSize);
+
+  if (fsync(fd) != 0 || close(fd) != 0 ||
+      rename(temporaryPath, path) != 0) {
+    printAndExit(NULL);
+  }
+
+  free(temporaryPath);
+  free(strings);
+  free(snapshotAcl);
+  free(snapshotFiles);
+  free(memberships);
+  free(snapshotGroups);
+  free(snapshotUsers);
+  free(numbers);
+  free(files);
+  free(groups);
+  free(users);
+}
+
+/**
+ * Returns the name at the offset of the string table, exits if the
+ * offset is outside of it
+ */
+char *getSnapshotString(char *strings, uint32_t stringsSize,
+                        uint32_t offset) {
+  if (offset >= stringsSize) {
+    printAndExit("Invalid snapshot");
+  }
+
+  return strings + offset;
+}
+
+/**
+ * Replaces the user definition section with the snapshot at the path.
+ * The snapshot is mapped and the users and groups keep pointing to
+ * the names in it. Only the indexes are rebuilt, nothing is parsed
+ */
+void loadSnapshot(char *path) {
+  struct snapshot_header *header;
+  struct snapshot_user *snapshotUsers;
+  struct snapshot_group *snapshotGroups;
+  struct snapshot_file *snapshotFiles;
+  struct snapshot_acl_entry *snapshotAcl;
+  struct user_struct **users;
+  struct group_struct **groups;
+  struct file_struct **files;
+  int32_t *memberships;
+  char *strings;
+  char *data;
+  struct stat status;
+  size_t expectedSize;
+  uint32_t i;
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0 || fstat(fd, &status) != 0) {
+    printAndExit(NULL);
+  }
+
+  if ((size_t)status.st_size < sizeof(struct snapshot_header)) {
+    printAndExit("Invalid snapshot");
+  }
+
+  data = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  if (data == MAP_FAILED) {
+    printAndExit(NULL);
+  }
+
+  close(fd);
+
+  header = (struct snapshot_header *)data;
+  // The counts are 32 bits so none of this can overflow
+  expectedSize = sizeof(struct snapshot_header) +
+                 header->usersCount * sizeof(struct snapshot_user) +
+                 header->groupsCount * sizeof(struct snapshot_group) +
+                 header->membershipsCount * sizeof(int32_t) +
+                 header->filesCount * sizeof(struct snapshot_file) +
+                 header->aclEntriesCount * sizeof(struct snapshot_acl_entry) +
+                 header->stringsSize;
+
+  if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+      expectedSize != (size_t)status.st_size || header->filesCount == 0 ||
+      (header->stringsSize > 0 &&
+       data[status.st_size - 1] != '\0')) {
+    printAndExit("Invalid snapshot");
+  }
+
+  snapshotJournalSequence = header->journalSequence;
+  journal.sequence = snapshotJournalSequence;
+  snapshotUsers = (struct snapshot_user *)(header + 1);
+  snapshotGroups = (struct snapshot_group *)(snapshotUsers +
+                                             header->usersCount);
+  memberships = (int32_t *)(snapshotGroups + header->groupsCount);
+  snapshotFiles =
+      (struct snapshot_file *)(memberships + header->membershipsCount);
+  snapshotAcl =
+      (struct snapshot_acl_entry *)(snapshotFiles + header->filesCount);
+  strings = (char *)(snapshotAcl + header->aclEntriesCount);
+
+  // Only offsets and indexes are checked, names are trusted to be
+  // valid and unique. A damaged snapshot can't make it read outside of
+  // the file but may leave some names out of the indexes
+  reserveNameIndex(&groupsIndex, header->groupsCount);
+  reserveNameIndex(&usersIndex, header->usersCount);
+
+  users = allocateSection(header->usersCount, sizeof(void *));
+  groups = allocateSection(header->groupsCount, sizeof(void *));
+  files = allocateSection(header->filesCount, sizeof(void *));
+
+  for (i = 0; i < header->groupsCount; i++) {
+    groups[i] = addGroup(getSnapshotString(strings, header->stringsSize,
+                                           snapshotGroups[i].name));
+  }
+
+  for (i = 0; i < header->usersCount; i++) {
+    struct snapshot_user *snapshotUser = &snapshotUsers[i];
+    struct membership *membership;
+    uint32_t j;
+
+    if (snapshotUser->firstMembership > header->membershipsCount ||
+        snapshotUser->membershipsCount >
+            header->membershipsCount - snapshotUser->firstMembership) {
+      printAndExit("Invalid snapshot");
+    }
+
+    users[i] = addUser(getSnapshotString(strings, header->stringsSize,
+                                         snapshotUser->name));
+
+    if (snapshotUser->membershipsCount == 0) {
+      continue;
+    }
+
+    // The group ids are already sorted, they are copied as they are
+    membership = malloc(sizeof(struct membership) +
+                        snapshotUser->membershipsCount * sizeof(int));
+
+    if (membership == NULL) {
+      printAndExit(NULL);
+    }
+
+    membership->version = treeVersion + 1;
+    membership->older = NULL;
+    membership->count = snapshotUser->membershipsCount;
+    membership->size = snapshotUser->membershipsCount;
+
+    for (j = 0; j < snapshotUser->membershipsCount; j++) {
+      int32_t groupId = memberships[snapshotUser->firstMembership + j];
+
+      if (groupId < 0 || (uint32_t)groupId >= header->groupsCount ||
+          (j > 0 && groupId <= membership->groupIds[j - 1])) {
+        printAndExit("Invalid snapshot");
+      }
+
+      membership->groupIds[j] = groupId;
+      linkUserAndGroup(users[i], groups[groupId]);
+    }
+
+    users[i]->membership = membership;
+  }
+
+  for (i = 0; i < header->filesCount; i++) {
+    struct snapshot_file *snapshotFile = &snapshotFiles[i];
+    struct file_struct *parent = NULL;
+    struct component_key key;
+    uint32_t j;
+
+    makeComponentKey(snapshotFile->cmpName,
+                     strnlen(snapshotFile->cmpName, MAX_CMP_SIZE), &key);
+
+    // Only the first file is the root
+    if ((i == 0) != (snapshotFile->parent < 0) ||
+        (i > 0 && (uint32_t)snapshotFile->parent >= i) ||
+        snapshotFile->firstAclEntry > header->aclEntriesCount ||
+        snapshotFile->aclEntriesCount >
+            header->aclEntriesCount - snapshotFile->firstAclEntry) {
+      printAndExit("Invalid snapshot");
+    }
+
+    if (i > 0) {
+      parent = files[snapshotFile->parent];
+    }
+
+    files[i] = createFile(&key, parent);
+
+    // The file inherited the ACL of its parent
+    if (parent != NULL &&
+        snapshotFile->firstAclEntry ==
+            snapshotFiles[snapshotFile->parent].firstAclEntry &&
+        snapshotFile->aclEntriesCount ==
+            snapshotFiles[snapshotFile->parent].aclEntriesCount) {
+      copyAcl(files[i], parent);
+      continue;
+    }
+
+    for (j = 0; j < snapshotFile->aclEntriesCount; j++) {
+      struct snapshot_acl_entry *entry =
+          &snapshotAcl[snapshotFile->firstAclEntry + j];
+      struct acl_entry *aclEntry = poolAlloc(&aclEntryPool);
+
+      if (entry->userId < ACL_ANY ||
+          entry->userId >= (int64_t)header->usersCount ||
+          entry->groupId < ACL_ANY ||
+          entry->groupId >= (int64_t)header->groupsCount) {
+        printAndExit("Invalid snapshot");
+      }
+
+      aclEntry->next = NULL;
+      aclEntry->user = entry->userId == ACL_ANY ? NULL : users[entry->userId];
+      aclEntry->group =
+          entry->groupId == ACL_ANY ? NULL : groups[entry->groupId];
+      aclEntry->readPermission = (entry->permissions & ACL_READ) != 0;
+      aclEntry->writePermission = (entry->permissions & ACL_WRITE) != 0;
+
+      if (files[i]->acl->tail == NULL) {
+        files[i]->acl->head = aclEntry;
+      } else {
+        files[i]->acl->tail->next = aclEntry;
+      }
+
+      files[i]->acl->tail = aclEntry;
+    }
+
+    compileAcl(files[i]);
+  }
+
+  root = files[0];
+
+  for (i = 0; i < header->usersCount; i++) {
+    int32_t file = snapshotUsers[i].file;
+
+    if (file < -1 || file >= (int64_t)header->filesCount) {
+      printAndExit("Invalid snapshot");
+    }
+
+    users[i]->file = file < 0 ? NULL : files[file];
+  }
+
+  free(files);
+  free(groups);
+  free(users);
+}
+
+/**
+ * Gets the permissions from the ACL entry and makes them into
+ * text
+ */
+void getPermissionsAsText(struct acl_entry *aclEntry, char permissions[3]) {
+  if (aclEntry->readPermission && aclEntry->writePermission) {
+    permissions[0] = 'r';
+    permissions[1] = 'w';
+    permissions[2] = '\0';
+  } else if (aclEntry->readPermission) {
+    permissions[0] = 'r';
+    permissions[1] = '\0';
+  } else if (aclEntry->writePermission) {
+    permissions[0] = 'w';
+    permissions[1] = '\0';
+  } else {
+    permissions[0] = '-';
+    permissions[1] = '\0';
+  }
+}
+
+/**
+ * Prints the whole ACL for a file. It is especially
+ * useful for debugging purposes
+ */
+void printAclForFile(struct file_struct *file) {
+  flushOutput();
+  printf("ACL for file %.*s\n", file->key.length,
+         getComponentName(&file->key));
+  struct acl_entry *aclEntry;
+
+  for (aclEntry = file->acl->head; aclEntry != NULL;
+       aclEntry = aclEntry->next) {
+    struct user_struct *user = aclEntry->user;
+    struct group_struct *group = aclEntry->group;
+    char permissions[3];
+
+    char *username;
+    char *groupname;
+
+    if (user != NULL) {
+      username = user->username;
+    } else {
+      username = "*";
+    }
+
+    if (group != NULL) {
+      groupname = group->groupname;
+    } else {
+      groupname = "*";
+    }
+
+    getPermissionsAsText(aclEntry, permissions);
+
+    printf("\t%s.%s %s\n", username, groupname, permissions);
+  }
+
+  fflush(stdout);
+}
+
+/**
+ * Gets the permissions string from the line while validating.
+ * It either returns the new position of the line after the
+ * permissions string, or NULL if an error is found. The error
+ * is stored in *error.
+ */
+char *getPermissions(char *line, char *end, char permissions[3],
+                     enum error_code *error) {
+  // rw
+  if (end - line == 2) {
+    if (line[0] != 'r' || line[1] != 'w') {
+      *error = E_INVALID_PERMISSIONS;
+      return NULL;
+    }
+
+    permissions[0] = 'r';
+    permissions[1] = 'w';
+    permissions[2] = '\0';
+
+    return (line + 2);
+  }
+
+  // r, w, -
+  if (end - line == 1) {
+    if (*line != 'r' && *line != 'w' && *line != '-') {
+      *error = E_INVALID_PERMISSIONS;
+      return NULL;
+    }
+
+    permissions[0] = *line;
+    permissions[1] = '\0';
+    return (line + 1);
+  }
+
+  *error = E_INVALID_PERMISSIONS;
+  return NULL;
+}
+
+/**
+ * This function ignores all lines until it finds one with a "."
+ * denoting the end of the ACL.
+ * It is especially useful when an error has been found
+ * on the command and there is no need to keep parsing
+ * the ACL
+ */
+void ignoreRestOfAcl() {
+  while (1) {
+    char *end;
+    char *line = getLine(&end);
+
+    if (line == end) {
+      break;
+    }
+
+    if (isEndOfList(line, end)) {
+      break;
+    }
+  }
+}
+
+/**
+ * Goes through the ACL specified in the input file line by line
+ * until it reaches the "." that means the ACL is done
+ * Returns E_NONE if the ACL is valid or the code of the error
+ * that was found otherwise
+ */
+enum error_code parseAclList(struct acl_entry **aclEntryHead,
+                             struct acl_entry **aclEntryTail) {
+  char *line;
+  char *end;
+  struct span username;
+  struct span groupname;
+  char permissions[3];
+  struct user_struct *user;
+  struct group_struct *group;
+  enum error_code error = E_NONE;
+
+  *aclEntryHead = NULL;
+  *aclEntryTail = NULL;
+
+  while (1) {
+    line = getLine(&end);
+
+    if (line == end) {
+      return E_END_OF_FILE;
+    }
+
+    if (isEndOfList(line, end)) {
+      return E_NONE;
+    }
+
+    line = getUsernameAndGroupnameForAcl(line, end, &username, &groupname,
+                                         &error);
+
+    if (line == NULL) {
+      return error;
+    }
+
+    if (isWildcard(username)) {
+      user = NULL;
+    } else {
+      user = findUserByUsername(username);
+
+      if (user == NULL) {
+        user = createUser(username);
+      }
+    }
+
+    if (isWildcard(groupname)) {
+      group = NULL;
+    } else {
+      group = findGroupByGroupname(groupname);
+
+      if (group == NULL) {
+        group = createGroup(groupname);
+      }
+    }
+
+    // Add user to group if necessary
+    if (user != NULL && group != NULL) {
+      addUserToGroup(user, group);
+    }
+
+    if (line == end || *line != ' ') {
+      return E_MISSING_PERMISSIONS;
+    }
+
+    // Skip ' '
+    line++;
+
+    line = getPermissions(line, end, permissions, &error);
+
+    if (line == NULL) {
+      return error;
+    }
+
+    if (*aclEntryHead == NULL) {
+      *aclEntryHead = createAclEntry(permissions, user, group);
+      *aclEntryTail = *aclEntryHead;
+    } else {
+      (*aclEntryTail)->next = createAclEntry(permissions, user, group);
+      *aclEntryTail = (*aclEntryTail)->next;
+    }
+  }
+
+  return E_NONE;
+}
+
+/**
+ * Replaces the ACL of the file with the list from head to tail. Other
+ * files sharing the old one keep it
+ */
+void setFileAcl(struct file_struct *file, struct acl_entry *aclEntryHead,
+                struct acl_entry *aclEntryTail) {
+  clearAclForFile(file);
+
+  file->acl = createAclList();
+  file->acl->head = aclEntryHead;
+  file->acl->tail = aclEntryTail;
+  compileAcl(file);
+}
+
+/**
+ * Removes the file from its parent. Queries from before the delete
+ * may still find it, so it is only freed once they are done
+ */
+void deleteFile(struct file_struct *file) {
+  removeChildFile(file->parent, file);
+  pathCacheDeleteGeneration++;
+  clearAclForFile(file);
+
+  storeShared(&file->deletedVersion, treeVersion + 1);
+  retireObject(file, RETIRED_FILE, treeVersion + 1, NULL);
+}
+
+/**
+ * Records a change to the file at the path in the journal. Created
+ * files and new ACLs come with the whole ACL the file ended up with,
+ * so replaying them doesn't need to know where it came from
+ */
+void journalFile(enum journal_record_type type, char *path,
+                 struct file_struct *file) {
+  struct acl_entry *aclEntry;
+  char permissions[3];
+
+  beginJournalRecord(type);
+  appendJournalString(path);
+
+  if (file != NULL) {
+    for (aclEntry = file->acl->head; aclEntry != NULL;
+         aclEntry = aclEntry->next) {
+      getPermissionsAsText(aclEntry, permissions);
+      appendJournalString(aclEntry->user ? aclEntry->user->username : "*");
+      appendJournalString(aclEntry->group ? aclEntry->group->groupname
+                                          : "*");
+      appendJournalString(permissions);
+    }
+  }
+
+  endJournalRecord();
+}
+
+/**
+ * Returns the summary of the file, allocating it the first time
+ */
+struct traverse_summary *getSummary(struct file_struct *file) {
+  int i;
+
+  if (file->summary == NULL) {
+    file->summary = poolAlloc(&summaryPool);
+    file->summary->generation = 0;
+
+    for (i = 0; i < SUMMARY_SLOTS; i++) {
+      file->summary->slots[i].generation = 0;
+    }
+  }
+
+  return file->summary;
+}
+
+/**
+ * Returns the slot of the user and group in the summary of the file
+ */
+struct read_memo *getSummarySlot(struct file_struct *file,
+                                 struct user_struct *user,
+                                 struct group_struct *group) {
+  int slot = (user->id * 31 + group->id) & (SUMMARY_SLOTS - 1);
+
+  return &getSummary(file)->slots[slot];
+}
+
+/**
+ * Returns who the latest ACL of the file lets read it
+ */
+enum traverse_state getAclReaders(struct file_struct *file) {
+  struct compiled_acl *compiledAcl = file->compiledAcl;
+  int readers = 0;
+  int i;
+
+  for (i = 0; i < compiledAcl->count; i++) {
+    if (compiledAcl->rules[i].permissions & ACL_READ) {
+      readers++;
+    }
+  }
+
+  // Without a "*.*" entry the fallback lets nobody in
+  if (compiledAcl->fallback & ACL_READ) {
+    return readers == compiledAcl->count ? TRAVERSE_ALL : TRAVERSE_SOME;
+  }
+
+  return readers == 0 ? TRAVERSE_NONE : TRAVERSE_SOME;
+}
+
+/**
+ * Returns who can read every file from the root down to the file at
+ * the latest version. It is worked out from the states of the files
+ * above it the first time it is needed after an ACL changes
+ */
+enum traverse_state getTraverseState(struct file_struct *file) {
+  struct traverse_summary *summary = getSummary(file);
+  enum traverse_state above = TRAVERSE_ALL;
+  enum traverse_state readers;
+
+  if (summary->generation == aclGeneration) {
+    return summary->state;
+  }
+
+  if (file->parent != NULL) {
+    above = getTraverseState(file->parent);
+  }
+
+  readers = getAclReaders(file);
+
+  if (above == TRAVERSE_NONE || readers == TRAVERSE_NONE) {
+    summary->state = TRAVERSE_NONE;
+  } else if (above == TRAVERSE_ALL && readers == TRAVERSE_ALL) {
+    summary->state = TRAVERSE_ALL;
+  } else {
+    summary->state = TRAVERSE_SOME;
+  }
+
+  summary->generation = aclGeneration;
+
+  return summary->state;
+}
+
+/**
+ * Returns 1 if the memo is valid for the user and group
+ */
+int hasReadMemo(struct read_memo *memo, struct user_struct *user,
+                struct group_struct *group) {
+  return memo->generation == aclGeneration && memo->userId == user->id &&
+         memo->groupId == group->id;
+}
+
+/**
+ * Records in the summary of the file whether the user and group can
+ * read every file down to it
+ */
+void setReadMemo(struct file_struct *file, struct user_struct *user,
+                 struct group_struct *group, int readable) {
+  struct read_memo *memo = getSummarySlot(file, user, group);
+
+  memo->userId = user->id;
+  memo->groupId = group->id;
+  memo->generation = aclGeneration;
+  memo->readable = readable;
+}
+
+/**
+ * Checks that the user and group can read every file from the file
+ * up to the root at the version. At the latest version the file is
+ * checked on its own and the walk over the directories above it stops
+ * at the first one that everybody or nobody can get to, or whose
+ * summary knows the user and group. So a file under a directory
+ * nobody can read is denied right there. The answer goes in the
+ * summaries of every directory visited. Summaries are only for the
+ * latest version, which only the main thread checks.
+ * Returns 1 if the whole path is readable, 0 otherwise
+ */
+int isPathReadable(struct user_struct *user, struct group_struct *group,
+                   struct file_struct *file, unsigned long version) {
+  struct file_struct *currentFile = file;
+  struct file_struct *window;
+  struct read_memo *memo;
+  enum traverse_state state;
+  int readable = 1;
+
+  if (version != VERSION_LATEST) {
+    for (; currentFile != NULL; currentFile = currentFile->parent) {
+      countWork(nodesVisited, 1);
+
+      if (!(getAclPermissions(currentFile, user, group, version) &
+            ACL_READ)) {
+        return 0;
+      }
+    }
+
+    return 1;
+  }
+
+  countWork(nodesVisited, 1);
+
+  if (!(getAclPermissions(file, user, group, version) & ACL_READ)) {
+    return 0;
+  }
+
+  currentFile = file->parent;
+
+  while (currentFile != NULL) {
+    countWork(nodesVisited, 1);
+    state = getTraverseState(currentFile);
+
+    if (state != TRAVERSE_SOME) {
+      readable = state == TRAVERSE_ALL;
+      break;
+    }
+
+    memo = getSummarySlot(currentFile, user, group);
+
+    if (hasReadMemo(memo, user, group)) {
+      readable = memo->readable;
+      break;
+    }
+
+    if (!(getAclPermissions(currentFile, user, group, version) & ACL_READ)) {
+      readable = 0;
+      setReadMemo(currentFile, user, group, readable);
+      break;
+    }
+
+    currentFile = currentFile->parent;
+  }
+
+  for (window = file->parent; window != currentFile;
+       window = window->parent) {
+    setReadMemo(window, user, group, readable);
+  }
+
+  return readable;
+}
+
+/**
+ * Performs validation on the inputs and then verifies that the
+ * user and group are allowed to read the file at the version
+ * Returns E_NONE if the command is valid and the operation is
+ * allowed, or the code of the error otherwise. The verdict of the
+ * error tells if the operation was not allowed or invalid
+ */
+enum error_code executeRead(struct user_struct *user,
+                            struct group_struct *group,
+                            struct file_struct *file,
+                            unsigned long version) {
+  if (!isPathReadable(user, group, file, version)) {
+    return E_CANT_READ;
+  }
+
+  return E_NONE;
+}
+
+/**
+ * Performs validation on the inputs and then verifies that the
+ * user and group are allowed to write to the file at the version
+ * Returns E_NONE if the command is valid and the operation is
+ * allowed, or the code of the error otherwise. The verdict of the
+ * error tells if the operation was not allowed or invalid
+ */
+enum error_code executeWrite(struct user_struct *user,
+                             struct group_struct *group,
+                             struct file_struct *file,
+                             unsigned long version) {
+  struct file_struct *parentFile = file->parent;
+
+  if (!(getAclPermissions(file, user, group, version) & ACL_WRITE)) {
+    return E_CANT_WRITE;
+  }
+
+  if (parentFile == NULL) {
+    return E_CANT_WRITE_ROOT;
+  }
+
+  return executeRead(user, group, parentFile, version);
+}
+
+/**
+ * Performs validation of the inputs and then verifies that the
+ * user and group can perform the acl operation on the file
+ * Returns E_NONE if the command is valid and the operation is
+ * allowed, or the code of the error otherwise. The verdict of the
+ * error tells if the operation was not allowed or invalid
+ */
+enum error_code executeAcl(struct user_struct *user,
+                           struct group_struct *group,
+                           struct file_struct *file) {
+  enum error_code result;
+  struct acl_entry *aclEntryHead;
+  struct acl_entry *aclEntryTail;
+
+  result = executeWrite(user, group, file, VERSION_LATEST);
+
+  if (result != E_NONE) {
+    return result;
+  }
+
+  result = parseAclList(&aclEntryHead, &aclEntryTail);
+
+  // Error already set
+  if (result != E_NONE) {
+    return result;
+  }
+
+  if (aclEntryHead == NULL || aclEntryTail == NULL) {
+    return E_NULL_ACL;
+  }
+
+  setFileAcl(file, aclEntryHead, aclEntryTail);
+
+  return E_NONE;
+}
+
+/**
+ * Performs some validation of the inputs and then verifies that the
+ * user and group can perform the create operation
+ * Returns E_NONE if the command is valid and the operation is
+ * allowed, or the code of the error otherwise. The verdict of the
+ * error tells if the operation was not allowed or invalid
+ */
+enum error_code executeCreate(struct user_struct *user,
+                              struct group_struct *group, char *filename) {
+  struct file_path filePath;
+  struct path_component *name;
+  enum error_code pathError;
+  enum error_code result;
+  struct file_struct *parentFile;
+  struct file_struct *newFile;
+  struct acl_entry *aclEntryHead;
+  struct acl_entry *aclEntryTail;
+
+  pathError = splitFilePath(filename, &filePath);
+
+  if (pathError == E_PATH_START) {
+    return E_PATH_START;
+  }
+
+  parentFile = findCreateParent(&filePath, pathError);
+
+  if (parentFile == NULL) {
+    return E_NO_PARENT;
+  }
+
+  result = executeWrite(user, group, parentFile, VERSION_LATEST);
+
+  if (result != E_NONE) {
+    return result;
+  }
+
+  name = &filePath.components[filePath.count - 1];
+
+  if (pathError == E_NONE &&
+      findChildByName(parentFile, &name->key, VERSION_LATEST) != NULL) {
+    return E_FILE_EXISTS;
+  }
+
+  result = parseAclList(&aclEntryHead, &aclEntryTail);
+
+  if (result != E_NONE) {
+    clearAclList(aclEntryHead);
+
+    return result;
+  }
+
+  newFile = createFile(&name->key, parentFile);
+
+  if (newFile == NULL) {
+    return E_FILE_EXISTS;
+  }
+
+  // If there was no ACL, inherit from parent directory
+  if (aclEntryHead == NULL) {
+    copyAcl(newFile, parentFile);
+  } else {
+    setFileAcl(newFile, aclEntryHead, aclEntryTail);
+  }
+
+  if (journal.recording) {
+    journalFile(J_CREATE, filename, newFile);
+  }
+
+  return E_NONE;
+}
+
+/**
+ * Performs validation to make sure that the file can be deleted,
+ * checks the the ACL to make sure that the user and group are
+ * allowed to delete the file.
+ * Returns E_NONE if the command is valid and the operation is
+ * allowed, or the code of the error otherwise. The verdict of the
+ * error tells if the operation was not allowed or invalid
+ */
+enum error_code executeDelete(struct user_struct *user,
+                              struct group_struct *group,
+                              struct file_struct *file) {
+  struct file_struct *parentFile = file->parent;
+  enum error_code result;
+
+  if (file->children != NULL) {
+    return E_HAS_CHILDREN;
+  }
+
+  // Root
+  if (parentFile == NULL) {
+    return E_DELETE_ROOT;
+  }
+
+  result = executeWrite(user, group, parentFile, VERSION_LATEST);
+
+  // Can't write
+  if (result != E_NONE) {
+    return result;
+  }
+
+  deleteFile(file);
+
+  return E_NONE;
+}
+
+/**
+ * Performs checks on the input and calls the appropriate command
+ * Returns E_NONE if the command is valid and the operation is
+ * allowed, or the code of the error otherwise. The verdict of the
+ * error tells if the operation was not allowed or invalid
+ */
+enum error_code executeCommand(char *command, struct span username,
+                               struct span groupname, char *filename) {
+  struct user_struct *user = findUserByUsername(username);
+  struct group_struct *group = findGroupByGroupname(groupname);
+  struct file_struct *file = findFileByPath(filename);
+  enum error_code result;
+
+  if (user == NULL) {
+    return E_NO_USER;
+  }
+
+  if (group == NULL) {
+    return E_NO_GROUP;
+  }
+
+  if (!userBelongsToGroup(user, group, VERSION_LATEST)) {
+    return E_NOT_IN_GROUP;
+  }
+
+  if (strcmp(command, "READ") == 0) {
+    if (file == NULL) {
+      return E_NO_FILE;
+    }
+
+    return executeRead(user, group, file, VERSION_LATEST);
+  }
+
+  if (strcmp(command, "WRITE") == 0) {
+    if (file == NULL) {
+      return E_NO_FILE;
+    }
+
+    return executeWrite(user, group, file, VERSION_LATEST);
+  }
+
+  if (strcmp(command, "CREATE") == 0) {
+    if (file != NULL) {
+      return E_FILE_EXISTS;
+    }
+
+    return executeCreate(user, group, filename);
+  }
+
+  if (strcmp(command, "DELETE") == 0) {
+    if (file == NULL) {
+      return E_NO_FILE;
+    }
+
+    result = executeDelete(user, group, file);
+
+    if (result == E_NONE && journal.recording) {
+      journalFile(J_DELETE, filename, NULL);
+    }
+
+    return result;
+  }
+
+  if (strcmp(command, "ACL") == 0) {
+    if (file == NULL) {
+      return E_NO_FILE;
+    }
+
+    result = executeAcl(user, group, file);
+
+    if (result == E_NONE && journal.recording) {
+      journalFile(J_ACL, filename, file);
+    }
+
+    return result;
+  }
+
+  return E_INVALID_COMMAND;
+}
+
+/**
+ * Returns the next string of a journal record and moves the cursor
+ * past it, NULL if the record has no strings left
+ */
+char *nextJournalString(char **cursor, char *end) {
+  char *string = *cursor;
+
+  if (string == end) {
+    return NULL;
+  }
+
+  *cursor += strlen(string) + 1;
+
+  return string;
+}
+
+/**
+ * Reads the ACL entries left in a journal record into a list.
+ * Returns 0 if an entry is incomplete or names a user or group that
+ * doesn't exist, 1 otherwise
+ */
+int readJournalAcl(char *cursor, char *end, struct acl_entry **aclEntryHead,
+                   struct acl_entry **aclEntryTail) {
+  struct acl_entry *aclEntry;
+  struct user_struct *user;
+  struct group_struct *group;
+  struct span username;
+  struct span groupname;
+  char *permissions;
+
+  *aclEntryHead = NULL;
+  *aclEntryTail = NULL;
+
+  while (cursor != end) {
+    username.start = nextJournalString(&cursor, end);
+    groupname.start = nextJournalString(&cursor, end);
+    permissions = nextJournalString(&cursor, end);
+
+    if (permissions == NULL) {
+      clearAclList(*aclEntryHead);
+      return 0;
+    }
+
+    username.length = strlen(username.start);
+    groupname.length = strlen(groupname.start);
+    user = isWildcard(username) ? NULL : findUserByUsername(username);
+    group = isWildcard(groupname) ? NULL : findGroupByGroupname(groupname);
+
+    if ((user == NULL && !isWildcard(username)) ||
+        (group == NULL && !isWildcard(groupname))) {
+      clearAclList(*aclEntryHead);
+      return 0;
+    }
+
+    aclEntry = createAclEntry(permissions, user, group);
+
+    if (*aclEntryHead == NULL) {
+      *aclEntryHead = aclEntry;
+    } else {
+      (*aclEntryTail)->next = aclEntry;
+    }
+
+    *aclEntryTail = aclEntry;
+  }
 
   return 1;
 }
 
 /**
- * Gets the permissions string from the line while validating.
- * It either returns the new position of the line after the
- * permissions string, or NULL if an error is found.
+ * Makes the change of a journal record again. Returns 0 if the record
+ * doesn't fit the state it is replayed on, 1 otherwise
+ */
+int replayJournalRecord(uint32_t type, char *payload, uint32_t length) {
+  char *cursor = payload;
+  char *end = payload + length;
+  struct span name;
+  struct span otherName;
+  struct user_struct *user;
+  struct group_struct *group;
+  struct file_struct *file;
+  struct acl_entry *aclEntryHead;
+  struct acl_entry *aclEntryTail;
+  struct file_path filePath;
+  enum error_code pathError;
+  struct component_key *key;
+
+  name.start = nextJournalString(&cursor, end);
+
+  if (name.start == NULL) {
+    return 0;
+  }
+
+  name.length = strlen(name.start);
+
+  if (type == J_USER) {
+    if (findUserByUsername(name) == NULL) {
+      createUser(name);
+    }
+
+    return 1;
+  }
+
+  if (type == J_GROUP) {
+    if (findGroupByGroupname(name) == NULL) {
+      createGroup(name);
+    }
+
+    return 1;
+  }
+
+  if (type == J_MEMBERSHIP) {
+    otherName.start = nextJournalString(&cursor, end);
+
+    if (otherName.start == NULL) {
+      return 0;
+    }
+
+    otherName.length = strlen(otherName.start);
+    user = findUserByUsername(name);
+    group = findGroupByGroupname(otherName);
+
+    if (user == NULL || group == NULL) {
+      return 0;
+    }
+
+    addUserToGroup(user, group);
+
+    return 1;
+  }
+
+  if (type == J_CREATE) {
+    pathError = splitFilePath(name.start, &filePath);
+    file = findCreateParent(&filePath, pathError);
+
+    if (file == NULL) {
+      return 0;
+    }
+
+    key = &filePath.components[filePath.count - 1].key;
+
+    if ((pathError == E_NONE &&
+         findChildByName(file, key, VERSION_LATEST) != NULL) ||
+        !readJournalAcl(cursor, end, &aclEntryHead, &aclEntryTail)) {
+      return 0;
+    }
+
+    setFileAcl(createFile(key, file), aclEntryHead, aclEntryTail);
+
+    return 1;
+  }
+
+  file = findFileByPath(name.start);
+
+  if (type == J_ACL) {
+    if (file == NULL ||
+        !readJournalAcl(cursor, end, &aclEntryHead, &aclEntryTail)) {
+      return 0;
+    }
+
+    setFileAcl(file, aclEntryHead, aclEntryTail);
+
+    return 1;
+  }
+
+  if (type == J_DELETE) {
+    if (file == NULL || file->parent == NULL || file->children != NULL) {
+      return 0;
+    }
+
+    deleteFile(file);
+
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Empties the journal file. The next record written to it is the one
+ * after the last record made so far
+ */
+void resetJournal() {
+  struct journal_header header;
+
+  memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+  header.firstSequence = journal.sequence + 1;
+
+  if (ftruncate(journal.fd, 0) != 0) {
+    printAndExit(NULL);
+  }
+
+  writeFileData(journal.fd, &header, sizeof(header));
+
+  if (fdatasync(journal.fd) != 0) {
+    printAndExit(NULL);
+  }
+}
+
+/**
+ * Opens the journal at the path and replays the records that came
+ * after the state that was loaded, then records every change from
+ * then on. A record that was cut short or damaged by a crash ends the
+ * journal and is cut off along with everything after it
+ */
+void openJournal(char *path) {
+  struct journal_header header;
+  struct journal_record record;
+  struct stat status;
+  unsigned long sequence;
+  size_t offset = sizeof(header);
+  size_t size;
+  char *payload;
+  char *data;
+
+  journal.fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+
+  if (journal.fd < 0 || fstat(journal.fd, &status) != 0) {
+    printAndExit(NULL);
+  }
+
+  journal.sequence = snapshotJournalSequence;
+  size = status.st_size;
+
+  // A new journal, or one whose header never made it to the disk
+  if (size < sizeof(header)) {
+    resetJournal();
+    journal.recording = 1;
+    return;
+  }
+
+  data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, journal.fd, 0);
+
+  if (data == MAP_FAILED) {
+    printAndExit(NULL);
+  }
+
+  memcpy(&header, data, sizeof(header));
+
+  // The records between the snapshot and the journal would be missing
+  if (memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0 ||
+      header.firstSequence == 0 ||
+      header.firstSequence > snapshotJournalSequence + 1) {
+    printAndExit("Invalid journal");
+  }
+
+  for (sequence = header.firstSequence;
+       offset + sizeof(record) <= size; sequence++) {
+    memcpy(&record, data + offset, sizeof(record));
+    payload = data + offset + sizeof(record);
+
+    if (record.length > size - offset - sizeof(record) ||
+        hashName(payload, record.length) != record.checksum ||
+        (record.length > 0 && payload[record.length - 1] != '\0')) {
+      break;
+    }
+
+    // The snapshot already has the records up to its own
+    if (sequence > snapshotJournalSequence) {
+      if (!replayJournalRecord(record.type, payload, record.length)) {
+        printAndExit("Invalid journal");
+      }
+
+      journal.sequence = sequence;
+      treeVersion++;
+    }
+
+    offset += sizeof(record) + record.length;
+  }
+
+  munmap(data, size);
+
+  if (journal.sequence == snapshotJournalSequence) {
+    resetJournal();
+  } else if (offset < size && ftruncate(journal.fd, offset) != 0) {
+    printAndExit(NULL);
+  }
+
+  journal.recording = 1;
+}
+
+/**
+ * Compares two names, returns 0 if they are the same
  */
-char *getPermissions(char *line, char permissions[3]) {
-  // rw
-  if (strlen(line) == 2) {
-    if (line[0] != 'r' || line[1] != 'w') {
-      setError("Invalid permissions");
-      return NULL;
+int compareSpans(struct span a, struct span b) {
+  if (a.length != b.length) {
+    return a.length - b.length;
+  }
+
+  return memcmp(a.start, b.start, a.length);
+}
+
+/**
+ * Checks a batch of READ and WRITE queries against the versions of
+ * the tree they carry with the same rules as executeCommand. The
+ * tree is not modified. results[i] is set to the error code of
+ * queries[i], E_NONE if the operation is allowed. Queries with no
+ * operation are skipped. Files, users and groups shared with the
+ * previous query are not looked up again. With --stats the time each
+ * query took is left in its latency
+ */
+void checkPermissions(struct permission_query *queries, int count,
+                      enum error_code *results) {
+  struct permission_query *query;
+  struct permission_query *previous = NULL;
+  struct file_struct *file = NULL;
+  struct user_struct *user = NULL;
+  struct group_struct *group = NULL;
+  unsigned long start = 0;
+  int i;
+
+  for (i = 0; i < count; i++) {
+    query = &queries[i];
+
+    if (query->operation == 0) {
+      continue;
     }
 
-    permissions[0] = 'r';
-    permissions[1] = 'w';
-    permissions[2] = '\0';
+    if (collectMetrics) {
+      start = getNanoseconds();
+    }
 
-    return (line + 2);
+    if (previous == NULL || query->version != previous->version ||
+        strcmp(query->path, previous->path) != 0) {
+      file = findFileAtVersion(query->path, query->version);
+    }
+
+    if (previous == NULL || query->version != previous->version ||
+        compareSpans(query->username, previous->username) != 0) {
+      user = findUserByUsername(query->username);
+
+      if (user != NULL && user->createdVersion > query->version) {
+        user = NULL;
+      }
+    }
+
+    if (previous == NULL || query->version != previous->version ||
+        compareSpans(query->groupname, previous->groupname) != 0) {
+      group = findGroupByGroupname(query->groupname);
+
+      if (group != NULL && group->createdVersion > query->version) {
+        group = NULL;
+      }
+    }
+
+    previous = query;
+
+    if (user == NULL) {
+      results[i] = E_NO_USER;
+    } else if (group == NULL) {
+      results[i] = E_NO_GROUP;
+    } else if (!userBelongsToGroup(user, group, query->version)) {
+      results[i] = E_NOT_IN_GROUP;
+    } else if (file == NULL) {
+      results[i] = E_NO_FILE;
+    } else if (query->operation == ACL_READ) {
+      results[i] = executeRead(user, group, file, query->version);
+    } else {
+      results[i] = executeWrite(user, group, file, query->version);
+    }
+
+    if (collectMetrics) {
+      query->latency = getNanoseconds() - start;
+    }
   }
+}
 
-  // r, w, -
-  if (strlen(line) == 1) {
-    if (*line != 'r' && *line != 'w' && *line != '-') {
-      setError("Invalid permissions");
-      return NULL;
+/**
+ * Splits a command line into the command, username, groupname and
+ * file path, all of them point into the line. command is set as soon
+ * as it is read, even if the rest of the line is invalid.
+ * Returns E_NONE if the line is valid or the code of the error that
+ * was found otherwise
+ */
+enum error_code parseCommandFields(char *line, char *end, char command[7],
+                                   struct span *username,
+                                   struct span *groupname,
+                                   struct span *filePath) {
+  int len = 0;
+  enum error_code error = E_NONE;
+
+  command[0] = '\0';
+
+  while (line == end || *line != ' ') {
+    if (len > 6 || line == end) {
+      command[0] = '\0';
+      return E_INVALID_COMMAND;
     }
 
-    permissions[0] = *line;
-    permissions[1] = '\0';
-    return (line + 1);
+    command[len] = *line;
+
+    len++;
+    line++;
   }
 
-  setError("Invalid permissions");
-  return NULL;
+  command[len] = '\0';
+
+  line++;
+
+  line = getUsernameAndGroupname(line, end, username, groupname, &error);
+
+  if (line == NULL) {
+    return error;
+  }
+
+  if (line == end || *line != ' ') {
+    return E_MISSING_FILE;
+  }
+
+  line++;
+  line = getFilepath(line, end, filePath, &error);
+
+  // Error already set
+  if (line == NULL) {
+    return error;
+  }
+
+  return E_NONE;
 }
 
 /**
- * Clears the ACL list and frees the memory
+ * Gets the command, username, groupname and file from the line
+ * and calls a function to execute it. With --stats the time it took
+ * is counted
  */
-void clearAclList(struct acl_entry *aclEntryHead) {
-  struct acl_entry *aclEntry = aclEntryHead;
+enum error_code parseCommandLine(char *line, char *end) {
+  char command[7];
+  char filename[MAX_FILE_NAME_SIZE + 1];
+  struct span username;
+  struct span groupname;
+  struct span filePath;
+  enum error_code result;
+  int createOrAcl = 0;
+  unsigned long start = collectMetrics ? getNanoseconds() : 0;
 
-  while (aclEntry != NULL) {
-    struct acl_entry *temp = aclEntry;
-    aclEntry = aclEntry->next;
-    free(temp);
+  result = parseCommandFields(line, end, command, &username, &groupname,
+                              &filePath);
+
+  if (strcmp(command, "CREATE") == 0 || strcmp(command, "ACL") == 0) {
+    createOrAcl = 1;
+  }
+
+  if (result == E_NONE) {
+    result = executeCommand(command, username, groupname,
+                            copyFilepath(filePath, filename));
+  }
+
+  if (result != E_NONE && createOrAcl) {
+    ignoreRestOfAcl();
+  }
+
+  if (collectMetrics) {
+    recordCommand(getCommandType(command), result,
+                  getNanoseconds() - start);
   }
+
+  return result;
 }
 
 /**
- * This function ignores all lines until it finds one with a "."
- * denoting the end of the ACL.
- * It is especially useful when an error has been found
- * on the command and there is no need to keep parsing
- * the ACL
+ * Returns the verdict of the error code as it is printed
  */
-void ignoreRestOfAcl() {
-  while (1) {
-    char *line = getLine();
+char *getVerdictText(enum error_code code) {
+  if (errors[code].verdict == C_YES) {
+    return "Y";
+  }
 
-    if (*line == '\0') {
-      free(line);
-      break;
-    }
+  if (errors[code].verdict == C_NO) {
+    return "N";
+  }
 
-    if (strcmp(line, ".") == 0) {
-      free(line);
-      break;
-    }
+  return "X";
+}
 
-    free(line);
-  }
+/**
+ * Checks the part of the batch assigned to the worker. Batches are
+ * split evenly between the worker threads
+ */
+void checkWorkerQueries(struct worker *worker, struct command_batch *batch) {
+  int parts = threadsCount - 1;
+  int start = batch->count * worker->index / parts;
+  int end = batch->count * (worker->index + 1) / parts;
+
+  checkPermissions(batch->queries + start, end - start,
+                   batch->results + start);
 }
 
 /**
- * Goes through the ACL specified in the input file line by line
- * until it reaches the "." that means the ACL is done
- * Returns
- *	C_YES If the command is valid and the operation is allowed
- *	C_INVALID If the command is invalid
+ * Body of the worker threads. Each one checks its part of every
+ * batch in order and reports back until the workers are stopped
  */
-int parseAclList(struct acl_entry **aclEntryHead,
-                 struct acl_entry **aclEntryTail) {
-  char *line;
-  char *username;
-  char *groupname;
-  char permissions[3];
-  struct user_struct *user;
-  struct group_struct *group;
+void *runWorker(void *argument) {
+  struct worker *worker = argument;
+  struct command_batch *batch;
+  unsigned long next = 0; // Number of the next batch to check
 
-  *aclEntryHead = NULL;
-  *aclEntryTail = NULL;
+  threadCounters = &workCounters[worker->index + 1];
 
   while (1) {
-    line = getLine();
-    char *startOfLine = line;
+    pthread_mutex_lock(&workersLock);
 
-    if (*line == '\0') {
-      free(startOfLine);
-      setError("Unexpected end of file");
-      return C_INVALID;
+    while (batchesDispatched == next && !workersStopping) {
+      pthread_cond_wait(&workReady, &workersLock);
     }
 
-    if (strcmp(line, ".") == 0) {
-      free(startOfLine);
-      return C_YES;
+    if (batchesDispatched == next) {
+      pthread_mutex_unlock(&workersLock);
+      return NULL;
     }
 
-    line = getUsernameAndGroupnameForAcl(line, &username, &groupname);
+    batch = &batches[next % BATCHES_IN_FLIGHT];
+    pthread_mutex_unlock(&workersLock);
 
-    if (line == NULL) {
-      free(startOfLine);
-      return C_INVALID;
-    }
+    checkWorkerQueries(worker, batch);
 
-    if (strcmp(username, "*") == 0) {
-      user = NULL;
-    } else {
-      user = findUserByUsername(username);
+    pthread_mutex_lock(&workersLock);
+    batch->pending--;
 
-      if (user == NULL) {
-        user = createUser(username);
-      }
+    if (batch->pending == 0) {
+      pthread_cond_signal(&workDone);
     }
 
-    if (strcmp(groupname, "*") == 0) {
-      group = NULL;
-    } else {
-      group = findGroupByGroupname(groupname);
+    pthread_mutex_unlock(&workersLock);
+    next++;
+  }
+}
 
-      if (group == NULL) {
-        group = createGroup(groupname);
-      }
-    }
+/**
+ * Starts a worker thread for every thread but the main one. Signals
+ * are blocked in the workers so that they interrupt the main thread
+ */
+void startWorkers() {
+  sigset_t signals;
+  sigset_t oldSignals;
+  int i;
 
-    // Add user to group if necessary
-    if (user != NULL && group != NULL) {
-      addUserToGroup(user, group);
-    }
+  sigfillset(&signals);
+  pthread_sigmask(SIG_SETMASK, &signals, &oldSignals);
 
-    if (*line != ' ') {
-      setError("Missing permissions");
-      free(startOfLine);
-      return C_INVALID;
+  for (i = 0; i < threadsCount - 1; i++) {
+    workers[i].index = i;
+    errno = pthread_create(&workers[i].thread, NULL, runWorker, &workers[i]);
+
+    if (errno != 0) {
+      printAndExit(NULL);
     }
+  }
 
-    // Skip ' '
-    line++;
+  pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+}
 
-    line = getPermissions(line, permissions);
+/**
+ * Tells the worker threads to finish and waits for them
+ */
+void stopWorkers() {
+  int i;
 
-    if (line == NULL) {
-      free(startOfLine);
-      return C_INVALID;
+  pthread_mutex_lock(&workersLock);
+  workersStopping = 1;
+  pthread_cond_broadcast(&workReady);
+  pthread_mutex_unlock(&workersLock);
+
+  for (i = 0; i < threadsCount - 1; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+}
+
+/**
+ * Returns the batch that lines are added to
+ */
+struct command_batch *getCurrentBatch() {
+  return &batches[batchesDispatched % BATCHES_IN_FLIGHT];
+}
+
+/**
+ * Prints the results of the batch in the order of the lines and
+ * empties it
+ */
+void printBatch(struct command_batch *batch) {
+  enum error_code result;
+  int i;
+
+  for (i = 0; i < batch->count; i++) {
+    result = batch->results[i];
+
+    // Commands that already ran were counted then
+    if (collectMetrics && batch->queries[i].operation != 0) {
+      recordCommand(batch->queries[i].operation == ACL_READ ? CMD_READ
+                                                            : CMD_WRITE,
+                    result, batch->queries[i].latency);
     }
 
-    if (*aclEntryHead == NULL) {
-      *aclEntryHead = createAclEntry(permissions, user, group);
-      *aclEntryTail = *aclEntryHead;
-    } else {
-      (*aclEntryTail)->next = createAclEntry(permissions, user, group);
-      *aclEntryTail = (*aclEntryTail)->next;
+    printResult(batch->firstNum + i, getVerdictText(result),
+                batch->lines[i].start, batch->lines[i].length,
+                errors[result].message);
+  }
+
+  batch->count = 0;
+  batch->textLength = 0;
+}
+
+/**
+ * Waits for the workers to check the oldest dispatched batch and
+ * prints it. Then what no query needs anymore is reclaimed
+ */
+void printOldestBatch() {
+  struct command_batch *batch = &batches[batchesPrinted % BATCHES_IN_FLIGHT];
+
+  pthread_mutex_lock(&workersLock);
+
+  while (batch->pending > 0) {
+    pthread_cond_wait(&workDone, &workersLock);
+  }
+
+  pthread_mutex_unlock(&workersLock);
+
+  printBatch(batch);
+  batchesPrinted++;
+  reclaimRetired();
+}
+
+/**
+ * Hands the current batch to the workers, lines are added to the next
+ * one while they check it. Without workers it is checked and printed
+ * right away
+ */
+void dispatchBatch() {
+  struct command_batch *batch = getCurrentBatch();
+
+  if (batch->count == 0) {
+    return;
+  }
+
+  if (threadsCount == 1) {
+    checkPermissions(batch->queries, batch->count, batch->results);
+    printBatch(batch);
+    return;
+  }
+
+  pthread_mutex_lock(&workersLock);
+  batch->pending = threadsCount - 1;
+  batchesDispatched++;
+  pthread_cond_broadcast(&workReady);
+  pthread_mutex_unlock(&workersLock);
+
+  // The next batch goes where the oldest one is
+  if (batchesDispatched - batchesPrinted == BATCHES_IN_FLIGHT) {
+    printOldestBatch();
+  }
+}
+
+/**
+ * Checks every line waiting in a batch and prints the results in the
+ * order of the lines
+ */
+void runBatch() {
+  dispatchBatch();
+
+  while (batchesPrinted < batchesDispatched) {
+    printOldestBatch();
+  }
+}
+
+/**
+ * Adds the line to the current batch with the result it has so far,
+ * num is the number of the line. The line and the path are copied to
+ * the batch. Full batches are dispatched first.
+ * Returns the query for the line, with no operation, or NULL if the
+ * line doesn't fit in a batch
+ */
+struct permission_query *addBatchLine(char *line, size_t length,
+                                      struct span path, int num,
+                                      enum error_code result) {
+  struct command_batch *batch = getCurrentBatch();
+  struct permission_query *query;
+  // The line followed by the NUL terminated path
+  size_t needed = length + path.length + 1;
+  char *text;
+
+  if (needed > BATCH_TEXT_SIZE) {
+    return NULL;
+  }
+
+  if (batch->count == BATCH_SIZE ||
+      batch->textLength + needed > BATCH_TEXT_SIZE) {
+    dispatchBatch();
+    batch = getCurrentBatch();
+  }
+
+  if (batch->count == 0) {
+    batch->firstNum = num;
+    batch->oldestVersion = VERSION_NEVER;
+  }
+
+  text = batch->text + batch->textLength;
+  memcpy(text, line, length);
+  memcpy(text + length, path.start, path.length);
+  text[length + path.length] = '\0';
+  batch->textLength += needed;
+
+  query = &batch->queries[batch->count];
+  query->path = text + length;
+  query->operation = 0;
+
+  batch->results[batch->count] = result;
+  batch->lines[batch->count].start = text;
+  batch->lines[batch->count].length = length;
+  batch->count++;
+
+  return query;
+}
+
+/**
+ * Adds the line to the batch if it is a valid READ or WRITE command,
+ * num is the number of the line. With worker threads it is checked
+ * against the current version of the tree, otherwise against the
+ * latest one when the batch runs.
+ * Returns 1 if the line was added, 0 if it has to be run on its own
+ */
+int addToBatch(char *line, char *end, int num) {
+  char command[7];
+  struct span username;
+  struct span groupname;
+  struct span filePath;
+  struct permission_query *query;
+  struct command_batch *batch;
+  char *text;
+  int operation;
+
+  if (parseCommandFields(line, end, command, &username, &groupname,
+                         &filePath) != E_NONE) {
+    return 0;
+  }
+
+  if (strcmp(command, "READ") == 0) {
+    operation = ACL_READ;
+  } else if (strcmp(command, "WRITE") == 0) {
+    operation = ACL_WRITE;
+  } else {
+    return 0;
+  }
+
+  query = addBatchLine(line, end - line, filePath, num, E_NONE);
+
+  if (query == NULL) {
+    return 0;
+  }
+
+  batch = getCurrentBatch();
+  text = batch->lines[batch->count - 1].start;
+
+  query->username.start = text + (username.start - line);
+  query->username.length = username.length;
+  query->groupname.start = text + (groupname.start - line);
+  query->groupname.length = groupname.length;
+  query->operation = operation;
+  query->version = snapshotsInUse ? treeVersion : VERSION_LATEST;
+
+  if (batch->oldestVersion == VERSION_NEVER) {
+    batch->oldestVersion = query->version;
+  }
+
+  // Interactive output can't wait for the rest of the batch
+  if (output.lineBuffered) {
+    runBatch();
+  }
+
+  return 1;
+}
+
+/**
+ * Prints the latency histogram as a JSON object. The buckets that
+ * have commands are listed as [smallest nanoseconds, commands]
+ */
+void printLatencyJson(struct latency_histogram *histogram) {
+  char *separator = "";
+  int bucket;
+
+  fprintf(stderr, "{\"p50\": %lu, \"p90\": %lu, \"p99\": %lu, "
+          "\"max\": %lu, \"buckets\": [",
+          getLatencyPercentile(histogram, 50),
+          getLatencyPercentile(histogram, 90),
+          getLatencyPercentile(histogram, 99), histogram->max);
+
+  for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+    if (histogram->counts[bucket] > 0) {
+      fprintf(stderr, "%s[%lu, %lu]", separator, getBucketStart(bucket),
+              histogram->counts[bucket]);
+      separator = ", ";
     }
+  }
 
-    free(startOfLine);
+  fprintf(stderr, "]}");
+}
+
+/**
+ * Prints the metrics of every command type and the work counters of
+ * every thread added up to STDERR as a JSON object
+ */
+void printMetrics() {
+  struct command_metrics *metrics;
+  struct work_counters total = {0, 0, 0};
+  int type;
+  int i;
+
+  for (i = 0; i < MAX_THREADS; i++) {
+    total.nodesVisited +=
+        __atomic_load_n(&workCounters[i].nodesVisited, __ATOMIC_RELAXED);
+    total.aclEntriesScanned +=
+        __atomic_load_n(&workCounters[i].aclEntriesScanned, __ATOMIC_RELAXED);
+    total.childrenScanned +=
+        __atomic_load_n(&workCounters[i].childrenScanned, __ATOMIC_RELAXED);
   }
 
-  return C_YES;
+  fprintf(stderr, "{\n  \"commands\": {\n");
+
+  for (type = 0; type < CMD_TYPES; type++) {
+    metrics = &commandMetrics[type];
+    fprintf(stderr, "    \"%s\": {\"count\": %lu, \"yes\": %lu, "
+            "\"no\": %lu, \"invalid\": %lu, \"latency_ns\": ",
+            commandNames[type], metrics->latency.total,
+            metrics->verdicts[C_YES], metrics->verdicts[C_NO],
+            metrics->verdicts[C_INVALID]);
+    printLatencyJson(&metrics->latency);
+    fprintf(stderr, "}%s\n", type + 1 < CMD_TYPES ? "," : "");
+  }
+
+  fprintf(stderr, "  },\n");
+  fprintf(stderr, "  \"nodes_visited\": %lu,\n", total.nodesVisited);
+  fprintf(stderr, "  \"acl_entries_scanned\": %lu,\n",
+          total.aclEntriesScanned);
+  fprintf(stderr, "  \"children_scanned\": %lu,\n", total.childrenScanned);
+  fprintf(stderr, "  \"path_cache_hits\": %lu,\n", pathCacheHits);
+  fprintf(stderr, "  \"path_cache_misses\": %lu\n}\n", pathCacheMisses);
+}
+
+/**
+ * Signal handler of SIGUSR1, the metrics are printed by the main loop
+ */
+void requestMetrics(int signal) {
+  (void)signal;
+  metricsRequested = 1;
 }
 
 /**
- * Clears the ACL for a file
+ * Prints the metrics if SIGUSR1 asked for them since the last time
  */
-void clearAclForFile(struct file_struct *file) { clearAclList(file->aclHead); }
+void printRequestedMetrics() {
+  if (metricsRequested) {
+    metricsRequested = 0;
+    printMetrics();
+  }
+}
 
 /**
- * Copies the ACL of one file to another file.
- * Especially useful when there is a need of
- * inheriting ACL
+ * Gets the command from the file and prints out the result
+ * of that line along with an error message if there was
+ * an error.
+ * Line is printed in the format
+ * <command number>	<Y/N/X>	<command input>	[error message]
  */
-void copyAcl(struct file_struct *dst, struct file_struct *src) {
-  clearAclForFile(dst);
+void parseFileOpearationSection() {
+  struct span noPath = {"", 0};
+  char *line;
+  char *end;
+  int len;
+  int num = 1;
+  enum error_code result;
 
-  struct acl_entry *srcAclEntry = src->aclHead;
-  struct acl_entry *dstAclEntry = NULL;
-  struct acl_entry *prev = NULL;
-  struct acl_entry *dstHead = NULL;
+  // Workers check queries against the version of the tree they were
+  // read at, so the other commands don't have to wait for them
+  snapshotsInUse = threadsCount > 1;
+  treeVersion++;
 
-  while (srcAclEntry != NULL) {
-    char permissions[3];
+  while (1) {
+    line = getLine(&end);
 
-    getPermissionsAsText(srcAclEntry, permissions);
+    if (line == end) {
+      break;
+    }
 
-    dstAclEntry =
-        createAclEntry(permissions, srcAclEntry->user, srcAclEntry->group);
+    printRequestedMetrics();
 
-    if (dstAclEntry == NULL) {
-      printAndExit(NULL);
+    // Runs of READ and WRITE commands are checked together
+    if (addToBatch(line, end, num)) {
+      num++;
+      continue;
     }
 
-    if (dstHead == NULL) {
-      dstHead = dstAclEntry;
+    // Anything else may change the tree, so without workers the batch
+    // goes first
+    if (!snapshotsInUse) {
+      runBatch();
     }
 
-    if (prev != NULL) {
-      prev->next = dstAclEntry;
+    // The ACL of CREATE and ACL commands is read after the command line
+    line = keepLine(line, &end);
+    len = end - line;
+
+    result = parseCommandLine(line, end);
+    treeVersion++;
+
+    // With workers the result waits for the lines before it
+    if (!snapshotsInUse ||
+        addBatchLine(line, len, noPath, num, result) == NULL) {
+      runBatch();
+      printResult(num, getVerdictText(result), line, len,
+                  errors[result].message);
+    } else if (output.lineBuffered) {
+      runBatch();
     }
 
-    prev = dstAclEntry;
-    srcAclEntry = srcAclEntry->next;
+    num++;
   }
 
-  dst->aclHead = dstHead;
-  dst->aclTail = dstAclEntry;
+  runBatch();
+
+  snapshotsInUse = 0;
+  reclaimRetired();
 }
 
 /**
- * Performs validation on the inputs and then verifies that the
- * user and group are allowed to read the file
- * Returns
- *	C_YES If the command is valid and the operation is allowed
- *	C_NO If the command is valid and the operation is not allowed
- *	C_INVALID If the command is invalid
- */
-int executeRead(struct user_struct *user, struct group_struct *group,
-                struct file_struct *file) {
-  struct file_struct *currentFile = file;
+ * Returns the length of the first command in the text if all of it
+ * is there, 0 otherwise. CREATE and ACL commands end after the "."
+ * line that closes their ACL, any other command is a single line.
+ * A line with no newline is only complete at the end of input
+ */
+size_t findCommandEnd(char *text, size_t length, int eof) {
+  char *end = text + length;
+  char *line = text;
+  char *newline = memchr(line, '\n', length);
 
-  while (currentFile != NULL) {
-    struct acl_entry *aclEntry =
-        findAclByFileUserAndGroup(currentFile, user, group);
+  if (newline == NULL) {
+    return eof ? length : 0;
+  }
+
+  if (!(newline - line > 7 && memcmp(line, "CREATE ", 7) == 0) &&
+      !(newline - line > 4 && memcmp(line, "ACL ", 4) == 0)) {
+    return newline + 1 - text;
+  }
 
-    if (aclEntry == NULL || !aclEntry->readPermission) {
-      setError("Can't read file");
-      return C_NO;
+  while (1) {
+    line = newline + 1;
+    newline = memchr(line, '\n', end - line);
+
+    if (newline == NULL) {
+      return eof ? length : 0;
     }
 
-    currentFile = currentFile->parent;
+    if (isEndOfList(line, newline)) {
+      return newline + 1 - text;
+    }
   }
-
-  return C_YES;
 }
 
 /**
- * Performs validation on the inputs and then verifies that the
- * user and group are allowed to write to the file
- * Returns
- *	C_YES If the command is valid and the operation is allowed
- *	C_NO If the command is valid and the operation is not allowed
- *	C_INVALID If the command is invalid
+ * Runs the command of the client that starts at command and has the
+ * given length. The command is parsed in place as if it was the
+ * program input and the result goes to the output of the client. An
+ * empty line ends the commands of the client just like it ends the
+ * file operation section
  */
-int executeWrite(struct user_struct *user, struct group_struct *group,
-                 struct file_struct *file) {
-  struct acl_entry *aclEntry = findAclByFileUserAndGroup(file, user, group);
-  struct file_struct *parentFile = file->parent;
+void runClientCommand(struct client *client, char *command, size_t length) {
+  struct line_reader savedInput = input;
+  enum error_code result;
+  char *line;
+  char *end;
+
+  output.client = client;
+  input.buffer = command;
+  input.size = length;
+  input.start = 0;
+  input.end = length;
+  input.eof = 1;
+  input.mapped = 1;
 
-  if (aclEntry == NULL || !aclEntry->writePermission) {
-    setError("No write permissions on this file");
-    return C_NO;
+  line = getLine(&end);
+
+  if (line == end) {
+    client->finished = 1;
+  } else {
+    result = parseCommandLine(line, end);
+    printResult(client->num, getVerdictText(result), line, end - line,
+                errors[result].message);
+    client->num++;
   }
 
-  if (parentFile == NULL) {
-    setError("No write permissions on root file");
-    return C_NO;
+  // ignoreRestOfAcl went past the command, it goes on with the lines
+  // the client hasn't sent yet
+  if (endOfInput && !client->closing) {
+    client->skippingAcl = 1;
   }
 
-  return executeRead(user, group, parentFile);
+  input = savedInput;
+  endOfInput = 0;
+
+  flushOutput();
+  output.client = NULL;
 }
 
 /**
- * Performs validation of the inputs and then verifies that the
- * user and group can perform the acl operation on the file
- * Returns
- *	C_YES If the command is valid and the operation is allowed
- *	C_NO If the command is valid and the operation is not allowed
- *	C_INVALID If the command is invalid
- */
-int executeAcl(struct user_struct *user, struct group_struct *group,
-               struct file_struct *file) {
-  int result;
-  struct acl_entry *aclEntryHead;
-  struct acl_entry *aclEntryTail;
-
-  result = executeWrite(user, group, file);
-
-  if (result != C_YES) {
-    return result;
-  }
-
-  result = parseAclList(&aclEntryHead, &aclEntryTail);
+ * Skips the line at the start of the text while the client is
+ * skipping an ACL, which stops at a "." or an empty line like
+ * ignoreRestOfAcl does.
+ * Returns the length of the line, 0 if it is not complete yet
+ */
+size_t skipClientAclLine(struct client *client, char *text, size_t length) {
+  char *newline = memchr(text, '\n', length);
 
-  // Error already set
-  if (result != C_YES) {
-    return result;
+  if (newline == NULL) {
+    return client->closing ? length : 0;
   }
 
-  if (aclEntryHead == NULL || aclEntryTail == NULL) {
-    setError("The file can't have a NULL ACL");
-    return C_INVALID;
+  if (newline == text || isEndOfList(text, newline)) {
+    client->skippingAcl = 0;
   }
 
-  clearAclForFile(file);
-
-  file->aclHead = aclEntryHead;
-  file->aclTail = aclEntryTail;
-
-  return C_YES;
+  return newline + 1 - text;
 }
 
 /**
- * Performs some validation of the inputs and then verifies that the
- * user and group can perform the create operation
- * Returns
- *	C_YES If the command is valid and the operation is allowed
- *	C_NO If the command is valid and the operation is not allowed
- *	C_INVALID If the command is invalid
- */
-int executeCreate(struct user_struct *user, struct group_struct *group,
-                  char *filename) {
-  char *fileLine = filename;
-  char *lastSlash = fileLine;
-  char *parentPath;
-  char *cmpName;
-  int index = 0;
-  int result;
-  char c;
-  struct file_struct *parentFile;
-  struct file_struct *newFile;
-  struct acl_entry *aclEntryHead;
-  struct acl_entry *aclEntryTail;
+ * Runs every complete command in the input of the client and drops
+ * it from the input. Everything left is run once the client stops
+ * sending
+ */
+void runClientCommands(struct client *client) {
+  size_t consumed = 0;
+  size_t length;
 
-  if (*lastSlash != '/') {
-    setError("File path must start with /");
+  while (!client->finished && consumed < client->inputLength) {
+    if (client->skippingAcl) {
+      length = skipClientAclLine(client, client->input + consumed,
+                                 client->inputLength - consumed);
+      consumed += length;
 
-    return C_INVALID;
-  }
+      if (length == 0) {
+        break;
+      }
 
-  while ((c = *fileLine) != '\0') {
-    if (c == '/') {
-      lastSlash = fileLine;
+      continue;
     }
 
-    fileLine++;
-  }
-
-  index = lastSlash - filename;
+    length = findCommandEnd(client->input + consumed,
+                            client->inputLength - consumed, client->closing);
 
-  parentPath = strndup(filename, index);
+    if (length == 0) {
+      break;
+    }
 
-  if (parentPath == NULL) {
-    printAndExit(NULL);
+    runClientCommand(client, client->input + consumed, length);
+    consumed += length;
   }
 
-  lastSlash++;
-  cmpName = strdup(lastSlash);
-
-  if (cmpName == NULL) {
-    printAndExit(NULL);
+  if (client->finished) {
+    consumed = client->inputLength;
   }
 
-  parentFile = findFileByPath(parentPath);
-
-  if (parentFile == NULL) {
-    setError("Parent file does not exist");
-
-    free(parentPath);
-    free(cmpName);
-
-    return C_INVALID;
-  }
+  memmove(client->input, client->input + consumed,
+          client->inputLength - consumed);
+  client->inputLength -= consumed;
+}
 
-  result = executeWrite(user, group, parentFile);
+/**
+ * Closes the connection with the client and frees it
+ */
+void closeClient(struct client *client) {
+  close(client->fd);
+  free(client->input);
+  free(client->output);
+  free(client);
+}
 
-  if (result != C_YES) {
-    free(parentPath);
-    free(cmpName);
+/**
+ * Reads what the client has sent, epoll tells again if there is
+ * more. Sets the closing flag of the client when it stops sending.
+ * The input grows up to MAX_CLIENT_INPUT_SIZE.
+ * Returns 0 if the connection failed or the input can't grow, 1
+ * otherwise
+ */
+int readClient(struct client *client) {
+  ssize_t bytesRead;
+  size_t size;
+  char *input;
 
-    return result;
-  }
+  if (client->inputLength == client->inputSize) {
+    if (client->inputSize >= MAX_CLIENT_INPUT_SIZE) {
+      return 0;
+    }
 
-  if (findFileByPath(filename) != NULL) {
-    free(parentPath);
-    free(cmpName);
+    size = client->inputSize ? client->inputSize * 2 : READ_BUFFER_SIZE;
 
-    setError("File already exists");
-    return C_INVALID;
-  }
+    if (size > MAX_CLIENT_INPUT_SIZE) {
+      size = MAX_CLIENT_INPUT_SIZE;
+    }
 
-  result = parseAclList(&aclEntryHead, &aclEntryTail);
+    // Running out of memory only costs this client its connection
+    input = realloc(client->input, size);
 
-  if (result != C_YES) {
-    free(parentPath);
-    free(cmpName);
-    clearAclList(aclEntryHead);
+    if (input == NULL) {
+      return 0;
+    }
 
-    return result;
+    client->input = input;
+    client->inputSize = size;
   }
 
-  newFile = createFile(cmpName, parentFile);
+  do {
+    bytesRead = read(client->fd, client->input + client->inputLength,
+                     client->inputSize - client->inputLength);
+  } while (bytesRead < 0 && errno == EINTR);
 
-  if (newFile == NULL) {
-    free(parentPath);
-    free(cmpName);
-    return C_INVALID;
+  if (bytesRead < 0) {
+    return errno == EAGAIN || errno == EWOULDBLOCK;
   }
 
-  // If there was no ACL, inherit from parent directory
-  if (aclEntryHead == NULL) {
-    copyAcl(newFile, parentFile);
-  } else {
-    newFile->aclHead = aclEntryHead;
-    newFile->aclTail = aclEntryTail;
+  if (bytesRead == 0) {
+    client->closing = 1;
   }
 
-  free(parentPath);
-  free(cmpName);
+  client->inputLength += bytesRead;
 
-  return C_YES;
+  return 1;
 }
 
 /**
- * Performs validation to make sure that the file can be deleted,
- * checks the the ACL to make sure that the user and group are
- * allowed to delete the file.
- * Returns
- *	C_YES If the command is valid and the operation is allowed
- *	C_NO If the command is valid and the operation is not allowed
- *	C_INVALID If the command is invalid
+ * Sends as much of the output of the client as the socket takes.
+ * Returns 0 if the connection failed, 1 otherwise
  */
-int executeDelete(struct user_struct *user, struct group_struct *group,
-                  struct file_struct *file) {
-  struct file_struct *parentFile = file->parent;
-  struct file_struct *window = parentFile->children;
-  int result;
+int writeClient(struct client *client) {
+  ssize_t bytesSent;
 
-  if (file->children != NULL) {
-    setError("Can't delete a file that has children");
-    return C_NO;
-  }
-
-  // Root
-  if (parentFile == NULL) {
-    setError("Can't delete the root file");
-    return C_NO;
-  }
+  // The changes of every client since the last commit go together
+  commitJournal();
 
-  result = executeWrite(user, group, parentFile);
+  while (client->outputSent < client->outputLength) {
+    bytesSent = send(client->fd, client->output + client->outputSent,
+                     client->outputLength - client->outputSent, MSG_NOSIGNAL);
 
-  // Can't write
-  if (result != C_YES) {
-    return result;
-  }
+    if (bytesSent < 0 && errno == EINTR) {
+      continue;
+    }
 
-  if (window == file) {
-    parentFile->children = file->next;
-  } else {
-    while (window != NULL) {
-      if (window->next == file) {
-        window->next = file->next;
-      }
+    if (bytesSent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return 1;
+    }
 
-      window = window->next;
+    if (bytesSent < 0) {
+      return 0;
     }
+
+    client->outputSent += bytesSent;
   }
 
-  clearAclForFile(file);
-  free(file);
+  client->outputSent = 0;
+  client->outputLength = 0;
 
-  return C_YES;
+  return 1;
 }
 
 /**
- * Performs checks on the input and calls the appropriate command
- * Returns
- *	C_YES If the command is valid and the operation is allowed
- *	C_NO If the command is valid and the operation is not allowed
- *	C_INVALID If the command is invalid
+ * Gives the client the error as the result of its next command, sends
+ * as much as the socket takes at once and closes the client
  */
-int executeCommand(char *command, char *username, char *groupname,
-                   char *filename) {
-  struct user_struct *user = findUserByUsername(username);
-  struct group_struct *group = findGroupByGroupname(groupname);
-  struct file_struct *file = findFileByPath(filename);
+void rejectClient(struct client *client, enum error_code error) {
+  output.client = client;
+  printResult(client->num, getVerdictText(error), NULL, 0,
+              errors[error].message);
+  flushOutput();
+  output.client = NULL;
+
+  writeClient(client);
+  closeClient(client);
+}
 
-  if (user == NULL) {
-    setError("User does not exist");
-    return C_INVALID;
+/**
+ * Handles the events of a client: reads its commands, runs them and
+ * sends back the results. The client is closed once it is done
+ * sending and every result is sent
+ */
+void handleClient(int epollFd, struct client *client, unsigned int events) {
+  struct epoll_event event;
+  unsigned int wanted;
+
+  if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !readClient(client)) {
+    closeClient(client);
+    return;
   }
 
-  if (group == NULL) {
-    setError("Group does not exist");
-    return C_INVALID;
+  runClientCommands(client);
+
+  if (client->failed) {
+    closeClient(client);
+    return;
   }
 
-  if (!userBelongsToGroup(user, group)) {
-    setError("User does not belong to group");
-    return C_INVALID;
+  // The input is full of a single command, a command this big is not
+  // sane
+  if (client->inputLength == MAX_CLIENT_INPUT_SIZE) {
+    rejectClient(client, E_COMMAND_SIZE);
+    return;
   }
 
-  if (strcmp(command, "READ") == 0) {
-    if (file == NULL) {
-      setError("File does not exist");
-      return C_INVALID;
-    }
+  if (!writeClient(client)) {
+    closeClient(client);
+    return;
+  }
 
-    return executeRead(user, group, file);
+  if (client->closing && client->outputLength == 0) {
+    closeClient(client);
+    return;
   }
 
-  if (strcmp(command, "WRITE") == 0) {
-    if (file == NULL) {
-      setError("File does not exist");
-      return C_INVALID;
-    }
+  // Only wait for the socket to be writable while output is pending
+  wanted = client->outputLength > 0 ? EPOLLOUT : 0;
 
-    return executeWrite(user, group, file);
+  // Finished clients are still read until they close, closing with
+  // unread input would reset the connection and lose the results
+  if (!client->closing) {
+    wanted |= EPOLLIN;
   }
 
-  if (strcmp(command, "CREATE") == 0) {
-    if (file != NULL) {
-      setError("File already exists");
+  if (wanted != client->events) {
+    client->events = wanted;
+    event.events = wanted;
+    event.data.ptr = client;
 
-      return C_INVALID;
+    if (epoll_ctl(epollFd, EPOLL_CTL_MOD, client->fd, &event) < 0) {
+      closeClient(client);
     }
-
-    return executeCreate(user, group, filename);
   }
+}
 
-  if (strcmp(command, "DELETE") == 0) {
-    if (file == NULL) {
-      setError("File does not exist");
-      return C_INVALID;
+/**
+ * Accepts every pending connection and starts watching it
+ */
+void acceptClients(int epollFd, int listenFd) {
+  struct epoll_event event;
+  struct client *client;
+  int fd;
+
+  while (1) {
+    fd = accept(listenFd, NULL, NULL);
+
+    if (fd < 0 && errno == EINTR) {
+      continue;
     }
 
-    return executeDelete(user, group, file);
-  }
+    if (fd < 0) {
+      // EAGAIN once there are no more, anything else is the client's
+      return;
+    }
 
-  if (strcmp(command, "ACL") == 0) {
-    if (file == NULL) {
-      setError("File does not exist");
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+      close(fd);
+      continue;
+    }
+
+    client = calloc(1, sizeof(struct client));
 
-      return C_INVALID;
+    // Only the new connection is lost, the others are still served
+    if (client == NULL) {
+      close(fd);
+      continue;
     }
 
-    return executeAcl(user, group, file);
+    client->fd = fd;
+    client->num = 1;
+    client->events = EPOLLIN;
+    event.events = EPOLLIN;
+    event.data.ptr = client;
+
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+      close(fd);
+      free(client);
+    }
   }
+}
 
-  setError("Invalid command");
-  return C_INVALID;
+/**
+ * Signal handler that makes the server stop
+ */
+void stopServer(int signal) {
+  (void)signal;
+  serverStopping = 1;
 }
 
 /**
- * Gets the command, username, groupname and file from the line
- * and calls a function to execute it
+ * Serves the file operation section over a Unix domain socket at the
+ * path until SIGINT or SIGTERM is received. Every connection sends
+ * commands like the ones of the file operation section and gets back
+ * the result lines, numbered from 1 for each connection. All of the
+ * connections share the same tree
  */
-int parseCommandLine(char *line) {
-  char command[7];
-  int len = 0;
-  char *username;
-  char *groupname;
-  char *filename;
-  char c;
-  int result;
-  int createOrAcl = 0;
+void runServer(char *path) {
+  struct epoll_event events[MAX_EVENTS];
+  struct epoll_event event;
+  struct sockaddr_un address;
+  struct sigaction action;
+  int listenFd;
+  int epollFd;
+  int count;
+  int i;
+
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    printAndExit("The socket path is too long");
+  }
 
-  while ((c = *line) != ' ') {
-    if (len > 6) {
-      setError("Invalid command");
-      return C_INVALID;
-    }
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
 
-    command[len] = *line;
+  listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 
-    len++;
-    line++;
+  if (listenFd < 0) {
+    printAndExit(NULL);
   }
 
-  command[len] = '\0';
+  unlink(path);
 
-  if (strcmp(command, "CREATE") == 0 || strcmp(command, "ACL") == 0) {
-    createOrAcl = 1;
+  if (bind(listenFd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+      listen(listenFd, SOMAXCONN) < 0) {
+    printAndExit(NULL);
   }
 
-  line++;
+  epollFd = epoll_create1(EPOLL_CLOEXEC);
 
-  line = getUsernameAndGroupname(line, &username, &groupname);
+  if (epollFd < 0) {
+    printAndExit(NULL);
+  }
 
-  if (line == NULL) {
-    if (createOrAcl) {
-      ignoreRestOfAcl();
-    }
+  event.events = EPOLLIN;
+  event.data.ptr = NULL;
 
-    return C_INVALID;
+  if (epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event) < 0) {
+    printAndExit(NULL);
   }
 
-  if (*line != ' ') {
-    if (createOrAcl) {
-      ignoreRestOfAcl();
-    }
+  // No SA_RESTART so that epoll_wait returns when a signal arrives
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = stopServer;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
 
-    setError("You have to include a file name");
-    return C_INVALID;
-  }
+  while (!serverStopping) {
+    printRequestedMetrics();
+    count = epoll_wait(epollFd, events, MAX_EVENTS, -1);
 
-  line++;
-  line = getFilepath(line, &filename);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
 
-  // Error msg already set.
-  if (line == NULL) {
-    if (createOrAcl) {
-      ignoreRestOfAcl();
+    if (count < 0) {
+      printAndExit(NULL);
     }
 
-    return C_INVALID;
+    for (i = 0; i < count; i++) {
+      if (events[i].data.ptr == NULL) {
+        acceptClients(epollFd, listenFd);
+      } else {
+        handleClient(epollFd, events[i].data.ptr, events[i].events);
+      }
+    }
   }
 
-  result = executeCommand(command, username, groupname, filename);
+  close(epollFd);
+  close(listenFd);
+  unlink(path);
+}
 
-  if (result != C_YES && createOrAcl) {
-    ignoreRestOfAcl();
+/**
+ * Prints the counters of a pool to STDERR
+ */
+void printPoolStats(char *name, struct pool *pool) {
+  fprintf(stderr, "%s pool: %lu allocated, %lu freed, %lu blocks\n", name,
+          pool->allocated, pool->freed, pool->blocksCount);
+}
+
+/**
+ * Frees all of the pools. Every file, ACL entry and membership is
+ * released at once without walking them
+ */
+void releasePools() {
+  releasePool(&filePool);
+  releasePool(&aclEntryPool);
+  releasePool(&userGroupPool);
+  releasePool(&groupUserPool);
+  releasePool(&compiledAclPool);
+  releasePool(&aclListPool);
+  releasePool(&summaryPool);
+  releasePool(&retiredPool);
+}
+
+/**
+ * Prints the internal counters to STDERR
+ */
+void printStats() {
+  struct rusage usage;
+  struct latency_histogram latency;
+  int type;
+
+  memset(&latency, 0, sizeof(latency));
+
+  for (type = 0; type < CMD_TYPES; type++) {
+    mergeLatency(&latency, &commandMetrics[type].latency);
   }
 
-  free(username);
-  free(groupname);
-  free(filename);
+  fprintf(stderr, "commands: %lu\n", latency.total);
+  fprintf(stderr, "latency p50: %lu ns\n",
+          getLatencyPercentile(&latency, 50));
+  fprintf(stderr, "latency p99: %lu ns\n",
+          getLatencyPercentile(&latency, 99));
+  fprintf(stderr, "path cache hits: %lu\n", pathCacheHits);
+  fprintf(stderr, "path cache misses: %lu\n", pathCacheMisses);
+  printPoolStats("file", &filePool);
+  printPoolStats("acl entry", &aclEntryPool);
+  printPoolStats("user group", &userGroupPool);
+  printPoolStats("group user", &groupUserPool);
+  printPoolStats("compiled acl", &compiledAclPool);
+  printPoolStats("acl list", &aclListPool);
+  printPoolStats("summary", &summaryPool);
+  printPoolStats("retired", &retiredPool);
+
+  if (journal.fd >= 0) {
+    fprintf(stderr, "journal records: %lu\n", journal.records);
+    fprintf(stderr, "journal commits: %lu\n", journal.commits);
+  }
 
-  return result;
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    fprintf(stderr, "peak rss: %ld KB\n", usage.ru_maxrss);
+  }
 }
 
 /**
- * Gets the command from the file and prints out the result
- * of that line along with an error message if there was
- * an error.
- * Line is printed in the format
- * <command number>	<Y/N/X>	<command input>	[error message]
+ * Main function.
  */
-void parseFileOpearationSection() {
-  char *line;
-  int num = 1;
-  int result;
-  char *error;
+int main(int argc, char *argv[]) {
+  char *socketPath = NULL;
+  char *loadSnapshotPath = NULL;
+  char *saveSnapshotPath = NULL;
+  char *journalPath = NULL;
+  char *scanName = NULL;
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--stats") == 0) {
+      printStatsAtExit = 1;
+      collectMetrics = 1;
+    } else if (strcmp(argv[i], "--metrics") == 0) {
+      printMetricsAtExit = 1;
+      collectMetrics = 1;
+    } else if (strcmp(argv[i], "--line-buffered") == 0) {
+      output.lineBuffered = 1;
+    } else if (strcmp(argv[i], "--input") == 0 && i + 1 < argc) {
+      openInputFile(argv[++i]);
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      threadsCount = atoi(argv[++i]);
+
+      if (threadsCount < 1 || threadsCount > MAX_THREADS) {
+        printAndExit("The number of threads must be between 1 and 64");
+      }
+    } else if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+      socketPath = argv[++i];
+    } else if (strcmp(argv[i], "--load-snapshot") == 0 && i + 1 < argc) {
+      loadSnapshotPath = argv[++i];
+    } else if (strcmp(argv[i], "--save-snapshot") == 0 && i + 1 < argc) {
+      saveSnapshotPath = argv[++i];
+    } else if (strcmp(argv[i], "--journal") == 0 && i + 1 < argc) {
+      journalPath = argv[++i];
+    } else if (strcmp(argv[i], "--scan") == 0 && i + 1 < argc) {
+      scanName = argv[++i];
+    } else {
+      printAndExit("Usage: acl_checker [--stats] [--line-buffered] "
+                   "[--input file] [--threads count] [--socket path] "
+                   "[--load-snapshot path] [--save-snapshot path] "
+                   "[--journal path] [--metrics] [--scan name]");
+    }
+  }
 
-  while (1) {
-    line = getLine();
+  selectCharacterScans(scanName);
 
-    if (*line == '\0') {
-      free(line);
-      break;
-    }
+  if (printMetricsAtExit) {
+    struct sigaction action;
 
-    result = parseCommandLine(line);
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = requestMetrics;
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &action, NULL);
+  }
 
-    if (result == C_YES) {
-      printf("%d\tY\t%s\n", num, line);
-    }
+  startWorkers();
 
-    if (result == C_NO) {
-      error = getError();
-      printf("%d\tN\t%s\t%s\n", num, line, error);
-    }
+  // A snapshot takes the place of the user definition section
+  if (loadSnapshotPath != NULL) {
+    loadSnapshot(loadSnapshotPath);
+  } else {
+    initFs();
+    parseUserDefinitionSection();
+  }
 
-    if (result == C_INVALID) {
-      error = getError();
-      printf("%d\tX\t%s\t%s\n", num, line, error);
+  // The journal has the changes made after the state above
+  if (journalPath != NULL) {
+    openJournal(journalPath);
+  }
+
+  if (socketPath != NULL) {
+    flushOutput();
+    runServer(socketPath);
+  } else {
+    parseFileOpearationSection();
+  }
+
+  stopWorkers();
+  flushOutput();
+  commitJournal();
+
+  // Once the snapshot has every record the journal can start over
+  if (saveSnapshotPath != NULL) {
+    saveSnapshot(saveSnapshotPath);
+
+    if (journal.fd >= 0) {
+      resetJournal();
     }
+  }
 
-    num++;
-    free(line);
+  if (printStatsAtExit) {
+    printStats();
   }
-}
 
-/**
- * Main function.
- */
-int main(int argc, char *argv[]) {
-  initFs();
-  parseUserDefinitionSection();
-  parseFileOpearationSection();
+  if (printMetricsAtExit) {
+    printMetrics();
+  }
+
+  releasePools();
 
   return 0;
 }